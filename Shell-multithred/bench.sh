@@ -0,0 +1,131 @@
+#!/bin/bash
+# Benchmarks of nyuenc that need a bigger host than the one it was written on (hardware counters, several CPUs).
+# usage: ./bench.sh hugepages [input]    dTLB misses of --perf with and without --hugepages (`make bench-hugepages`)
+#        ./bench.sh shm [input]          --shm against a pipe read with splice(2) or read(2) (`make bench-shm`)
+# without an input, 512MB of base64 text is made in a temporary directory.
+
+NYUENC=$(realpath "${NYUENC:-./nyuenc}")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+TIMEFORMAT='%R s'
+
+# the input given, or 512MB of text with short runs
+input() {
+    if [ -n "$1" ]; then
+        realpath "$1"
+    else
+        head -c 400M /dev/urandom | base64 -w 0 | head -c 512M > "$DIR/input"
+        echo "$DIR/input"
+    fi
+}
+
+# the counters of all threads for each phase with and without --hugepages, dTLB-miss/KB is the last column
+hugepages() {
+    local input=$(input "$1") threads=$(nproc)
+    for options in "" "--hugepages"; do
+        echo "== nyuenc -j $threads --perf $options ($(stat -c %s "$input") bytes)"
+        { time "$NYUENC" -j $threads --perf $options "$input" 2> "$DIR/perf" > /dev/null; } 2>&1
+        grep -E "thread +phase|^nyuenc: all |not available" "$DIR/perf"
+    done
+}
+
+# consumers of the output: shmsum sums the bytes of each slot of the ring in place, splicenull moves the pipe to
+# /dev/null with splice(2) without reading it, readsum reads the pipe into a buffer and sums the bytes
+consumers() {
+    cat > "$DIR/shmsum.c" << 'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include "nyuring.h"
+
+int main(int argc, char *argv[]) {
+    NyuReader reader;
+    if (argc != 2 || nyuring_open(&reader, argv[1]) == -1) {
+        perror("nyuring_open");
+        exit(EXIT_FAILURE);
+    }
+    unsigned long sum = 0;
+    size_t len;
+    const unsigned char *p;
+    while ((p = nyuring_next(&reader, &len)) != NULL) {
+        for (size_t i = 0; i < len; i++) {
+            sum += p[i];
+        }
+        nyuring_release(&reader);
+    }
+    nyuring_close(&reader);
+    printf("%lu\n", sum);
+    return 0;
+}
+EOF
+    cat > "$DIR/splicenull.c" << 'EOF'
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+
+int main(void) {
+    int null = open("/dev/null", O_WRONLY);
+    ssize_t n;
+    while ((n = splice(0, NULL, null, NULL, 1 << 20, SPLICE_F_MOVE)) > 0) {
+    }
+    if (n == -1) {
+        perror("splice");
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+EOF
+    cat > "$DIR/readsum.c" << 'EOF'
+#include <stdio.h>
+#include <unistd.h>
+
+int main(void) {
+    static unsigned char buf[1 << 20];
+    unsigned long sum = 0;
+    ssize_t n;
+    while ((n = read(0, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; i++) {
+            sum += buf[i];
+        }
+    }
+    printf("%lu\n", sum);
+    return 0;
+}
+EOF
+    for consumer in shmsum splicenull readsum; do
+        ${CC:-cc} -O2 -std=gnu17 -I"$(dirname "$NYUENC")" -o "$DIR/$consumer" "$DIR/$consumer.c" || exit 1
+    done
+}
+
+# wait for nyuenc to create the ring of name
+wait_shm() {
+    while [ ! -e /dev/shm$1 ]; do
+        sleep 0.001
+    done
+}
+
+# wall time of the output consumed through the ring of --shm, and through a pipe
+shm() {
+    local input=$(input "$1") threads=$(nproc) name=/nyuenc-bench-$$
+    consumers
+    echo "== nyuenc -j $threads ($(stat -c %s "$input") bytes, $("$NYUENC" -j $threads "$input" | wc -c) out)"
+    echo -n "--shm, summed in place:     "
+    { time { "$NYUENC" -j $threads --shm $name "$input" & wait_shm $name; "$DIR/shmsum" $name > /dev/null; wait; }; } 2>&1
+    echo -n "pipe, splice to /dev/null:  "
+    { time "$NYUENC" -j $threads "$input" | "$DIR/splicenull"; } 2>&1
+    echo -n "pipe, read and summed:      "
+    { time "$NYUENC" -j $threads "$input" | "$DIR/readsum" > /dev/null; } 2>&1
+}
+
+case "$1" in
+hugepages)
+    hugepages "$2"
+    ;;
+shm)
+    shm "$2"
+    ;;
+*)
+    echo "usage: $0 hugepages|shm [input]" >&2
+    exit 1
+    ;;
+esac
@@ -0,0 +1,948 @@
+// decode.c: the decoders of `nyuenc decode` and `nyuenc check`, and the verifier threads of `--verify`
+// that decode the output while it is written.
+
+#include "nyuenc.h"
+
+// Expand a run of bits into data, `bits` holds the `*num_bits` bits of the byte not complete yet.
+// Return the new length of data.
+size_t expand_bits(unsigned char *data, size_t n, unsigned char bit, size_t count, unsigned *bits, int *num_bits) {
+    while (count > 0 && *num_bits > 0) {
+        *bits = (*bits << 1) | bit;
+        count--;
+        if (++*num_bits == 8) {
+            data[n++] = *bits;
+            *bits = 0;
+            *num_bits = 0;
+        }
+    }
+    memset(data + n, bit ? 0xFF : 0x00, count / 8);
+    n += count / 8;
+    for (size_t b = 0; b < count % 8; b++) {
+        *bits = (*bits << 1) | bit;
+        (*num_bits)++;
+    }
+    return n;
+}
+
+/* Verification: `--verify` maps the inputs a second time and checks the output against them while it is written.
+   The writer writes through a stdio cookie that also cuts the output into segments of whole pairs (or frames),
+   verifier threads decode the segments in parallel and compare them with the input. The offset of a segment in
+   the input is only known once the segments before it are decoded, so each thread decodes its segment first,
+   takes its offset in order (a relay on VERIFY_NEXT), then expands and compares in parallel. */
+
+// VerifyFile struct for an input mapped for `--verify`
+typedef struct {
+    const unsigned char *addr;
+    size_t len;
+    size_t offset;                      // Offset in the input
+} VerifyFile;
+
+VerifyFile *VERIFY_FILES = NULL;
+int NUM_VERIFY_FILES = 0;
+size_t VERIFY_INPUT_LEN = 0;
+
+// Fail `--verify` loudly, the output is not the input
+void verify_failed(const char *message, size_t offset) {
+    fprintf(stderr, "nyuenc: verify failed: %s at input offset %zu\n", message, offset);
+    exit(EXIT_FAILURE);
+}
+
+// The byte of the input at offset
+unsigned char input_byte(size_t offset) {
+    for (int f = 0; f < NUM_VERIFY_FILES; f++) {
+        if (offset < VERIFY_FILES[f].offset + VERIFY_FILES[f].len) {
+            return VERIFY_FILES[f].addr[offset - VERIFY_FILES[f].offset];
+        }
+    }
+    verify_failed("output is longer than the input", offset);
+    return 0;
+}
+
+// Compare decoded bytes with the input at offset, file by file with memcmp
+void verify_input(const unsigned char *data, size_t n, size_t offset) {
+    if (offset + n > VERIFY_INPUT_LEN) {
+        verify_failed("output is longer than the input", VERIFY_INPUT_LEN);
+    }
+    for (int f = 0; f < NUM_VERIFY_FILES && n > 0; f++) {
+        VerifyFile *file = &VERIFY_FILES[f];
+        if (offset >= file->offset + file->len) {
+            continue;
+        }
+        size_t len = (file->offset + file->len - offset < n) ? file->offset + file->len - offset : n;
+        if (memcmp(data, file->addr + (offset - file->offset), len) != 0) {
+            size_t k = 0;
+            while (data[k] == file->addr[offset - file->offset + k]) {
+                k++;
+            }
+            verify_failed("decoded byte differs", offset + k);
+        }
+        data += len;
+        offset += len;
+        n -= len;
+    }
+}
+
+// Decoder struct for the state of `nyuenc decode` in one file
+typedef struct {
+    StreamHeader header;
+    size_t size;                        // Bytes of an element
+    size_t pair_len;
+    unsigned char *buffer;              // `MAX_STRIDE` decoded bytes before data, for undoing the filter
+    unsigned char *data;
+    size_t buffer_len;
+    size_t n;                           // Bytes in data
+    unsigned bits;                      // Bits of `--width=bit` for the byte not complete yet
+    int num_bits;
+    size_t offset;                      // Bytes written, the offset in the base file of `--base`
+    bool verify;                        // Compare with the input of `--verify` instead of writing
+    uint32_t crc;                       // CRC32C of the bytes written since the start of the frame of `--crc`
+} Decoder;
+
+// Undo the filter of the decoded bytes in data and write them out
+void flush_decoded(Decoder *decoder) {
+    size_t stride = decoder->header.stride;
+    if (decoder->header.filter != FILTER_NONE) {
+        FILTERS[decoder->header.filter].invert(decoder->data - stride, decoder->n + stride, stride);
+        memmove(decoder->data - stride, decoder->data + decoder->n - stride, stride);
+    }
+    if (decoder->header.base) {
+        xor_base(decoder->data, decoder->data, decoder->n, decoder->offset);
+    }
+    if (decoder->header.crc) {
+        decoder->crc = crc32c(decoder->crc, decoder->data, decoder->n);
+    }
+    if (decoder->verify) {
+        verify_input(decoder->data, decoder->n, decoder->offset);
+    } else if (fwrite(decoder->data, sizeof(unsigned char), decoder->n, stdout) != decoder->n) {
+        handle_error("write output failed", -1);
+    }
+    decoder->offset += decoder->n;
+    decoder->n = 0;
+}
+
+// Expand a run of elements (or bits) into the decoded bytes
+void decode_run(Decoder *decoder, const unsigned char *element, uint64_t count) {
+    while (count > 0) {
+        size_t room = (decoder->buffer_len - decoder->n) / decoder->size;
+        if (room < 8) {
+            flush_decoded(decoder);
+            continue;
+        }
+
+        if (decoder->header.width == 1) {
+            // whole bytes go out 8 bits at once, room is in bytes
+            uint64_t take = (count > room * 8) ? room * 8 : count;
+            decoder->n = expand_bits(decoder->data, decoder->n, element[0], take, &decoder->bits, &decoder->num_bits);
+            count -= take;
+        } else if (decoder->size == 1) {
+            uint64_t take = (count > room) ? room : count;
+            memset(decoder->data + decoder->n, element[0], take);
+            decoder->n += take;
+            count -= take;
+        } else {
+            uint64_t take = (count > room) ? room : count;
+            for (uint64_t c = 0; c < take; c++, decoder->n += decoder->size) {
+                memcpy(decoder->data + decoder->n, element, decoder->size);
+            }
+            count -= take;
+        }
+    }
+}
+
+// Expand pairs into the decoded bytes, exit on pairs no encoder writes
+void decode_pairs(Decoder *decoder, const unsigned char *p, size_t len) {
+    if (len % decoder->pair_len != 0) {
+        fprintf(stderr, "nyuenc: not an encoded file (partial pair)\n");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t j = 0; j < len; j += decoder->pair_len) {
+        unsigned char count = p[j + decoder->pair_len - 1];
+        if (count == 0 && decoder->header.width > 8) {
+            // trailer of a partial element, shorter than an element
+            if (p[j] == 0 || p[j] >= decoder->size) {
+                fprintf(stderr, "nyuenc: not an encoded file (trailer of %u bytes)\n", p[j]);
+                exit(EXIT_FAILURE);
+            }
+            if (decoder->n + decoder->size > decoder->buffer_len) {
+                flush_decoded(decoder);
+            }
+            memcpy(decoder->data + decoder->n, p + j + 1, p[j]);
+            decoder->n += p[j];
+        } else {
+            decode_run(decoder, p + j, count);
+        }
+    }
+}
+
+// Read the code lengths written by write_lengths(), return the bytes read or 0 if they do not fit in len
+size_t read_lengths(const unsigned char *p, size_t len, Huffman *huffman) {
+    if (len < 32) {
+        return 0;
+    }
+    size_t pos = 32;
+    int used = 0;
+    for (int c = 0; c < 256; c++) {
+        huffman->lengths[c] = 0;
+        if (!(p[c / 8] & (1 << (c % 8)))) {
+            continue;
+        }
+        if (used % 2 == 0 && pos >= len) {
+            return 0;
+        }
+        huffman->lengths[c] = (used % 2 == 0) ? (p[pos++] & 0xF) : (p[pos - 1] >> 4);
+        used++;
+    }
+    canonical_codes(huffman);
+    return pos;
+}
+
+// The LOOKUP_BITS bits of body at `bit`, zeros past the end
+unsigned peek_bits(const unsigned char *body, size_t body_len, size_t bit) {
+    uint32_t window = 0;
+    for (size_t k = 0; k < 3; k++) {
+        window = (window << 8) | ((bit / 8 + k < body_len) ? body[bit / 8 + k] : 0);
+    }
+    return (window >> (24 - LOOKUP_BITS - bit % 8)) & ((1 << LOOKUP_BITS) - 1);
+}
+
+// Decode a Huffman frame body into pairs. Short codes take one lookup of their next LOOKUP_BITS bits, longer ones
+// go bit by bit through the canonical code. Return false if it is corrupt.
+bool decode_huffman(const unsigned char *body, size_t body_len, unsigned char *pairs, size_t len, size_t pair_len) {
+    Huffman huffman[2];
+    uint16_t lookup[2][1 << LOOKUP_BITS];      // length << 8 | symbol, 0 for a longer code
+    size_t pos = 4;
+    for (int t = 0; t < 2; t++) {
+        size_t read = read_lengths(body + pos, body_len - pos, &huffman[t]);
+        if (read == 0) {
+            return false;
+        }
+        pos += read;
+
+        memset(lookup[t], 0, sizeof(lookup[t]));
+        for (int c = 0; c < 256; c++) {
+            int len_code = huffman[t].lengths[c];
+            if (len_code == 0 || len_code > LOOKUP_BITS) {
+                continue;
+            }
+            unsigned from = (unsigned)huffman[t].codes[c] << (LOOKUP_BITS - len_code);
+            for (unsigned k = 0; k < 1u << (LOOKUP_BITS - len_code) && from + k < (1u << LOOKUP_BITS); k++) {
+                lookup[t][from + k] = len_code << 8 | c;
+            }
+        }
+    }
+
+    size_t bit = pos * 8;
+    for (size_t j = 0; j < len; j++) {
+        int t = j % pair_len == pair_len - 1;
+        uint16_t entry = lookup[t][peek_bits(body, body_len, bit)];
+        if (entry != 0) {
+            bit += entry >> 8;
+            if (bit > body_len * 8) {
+                return false;
+            }
+            pairs[j] = entry & 0xFF;
+            continue;
+        }
+
+        const Huffman *code = &huffman[t];
+        int first = 0, index = 0, value = 0;
+        int len_code;
+        for (len_code = 1; len_code <= MAX_CODE_LEN; len_code++) {
+            if (bit >= body_len * 8) {
+                return false;
+            }
+            value = (value << 1) | ((body[bit / 8] >> (7 - bit % 8)) & 1);
+            bit++;
+            if (value >= first && value - first < code->count[len_code]) {
+                pairs[j] = code->sorted[index + value - first];
+                break;
+            }
+            index += code->count[len_code];
+            first = (first + code->count[len_code]) << 1;
+        }
+        if (len_code > MAX_CODE_LEN) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Frame struct for a frame of `--entropy` found by `nyuenc decode`, decoded in parallel with the others
+typedef struct {
+    const unsigned char *body;
+    size_t body_len;
+    int type;
+    unsigned char *pairs;               // Decoded pairs of a Huffman frame
+    size_t len;
+    bool ok;
+} Frame;
+
+// FrameWork struct for the frames decoded by one thread
+typedef struct {
+    Frame *frames;
+    size_t num_frames;
+    size_t first;                       // Thread takes frames first, first + step, ...
+    size_t step;
+    size_t pair_len;
+} FrameWork;
+
+// Decode the Huffman frames of one thread
+void *frame_process(void *args) {
+    FrameWork *work = args;
+    for (size_t f = work->first; f < work->num_frames; f += work->step) {
+        Frame *frame = &work->frames[f];
+        if (frame->type == FRAME_HUFFMAN) {
+            frame->ok = decode_huffman(frame->body, frame->body_len, frame->pairs, frame->len, work->pair_len);
+        }
+    }
+    return NULL;
+}
+
+// Decode the frames of `--entropy` in batches: the Huffman frames of a batch are decoded by `num_threads` threads,
+// then the pairs are expanded in order
+void decode_frames(Decoder *decoder, const char *path, const unsigned char *p, size_t len, int num_threads) {
+    size_t batch_pairs = 16 << 20;
+    size_t max_frames = 4096;
+    Frame *frames = malloc(max_frames * sizeof(Frame));
+    unsigned char *pairs = malloc(batch_pairs + 2 * MAX_CHUNK_SIZE * MAX_PAIR_LEN);
+    size_t pos = decoder->header.len;
+
+    while (pos < len) {
+        // collect a batch of frames
+        size_t num_frames = 0, used = 0;
+        while (pos < len && num_frames < max_frames && used < batch_pairs) {
+            Frame *frame = &frames[num_frames];
+            if (len - pos < FRAME_HEAD_LEN || get_le(p + pos + 1, 4) > len - pos - FRAME_HEAD_LEN) {
+                fprintf(stderr, "nyuenc: %s: truncated frame\n", path);
+                exit(EXIT_FAILURE);
+            }
+            frame->type = p[pos];
+            frame->body_len = get_le(p + pos + 1, 4);
+            frame->body = p + pos + FRAME_HEAD_LEN;
+            frame->ok = true;
+            if (frame->type == FRAME_HUFFMAN) {
+                frame->len = (frame->body_len >= 4) ? get_le(frame->body, 4) : 0;
+                if (frame->len > 2 * MAX_CHUNK_SIZE * MAX_PAIR_LEN || frame->len % decoder->pair_len != 0) {
+                    frame->ok = false;
+                    frame->len = 0;
+                }
+                frame->pairs = pairs + used;
+                used += frame->len;
+            }
+            pos += FRAME_HEAD_LEN + frame->body_len;
+            num_frames++;
+        }
+
+        int n = (num_threads < (int)num_frames) ? num_threads : (int)num_frames;
+        pthread_t threads[n];
+        FrameWork works[n];
+        for (int t = 0; t < n; t++) {
+            works[t] = (FrameWork){frames, num_frames, t, n, decoder->pair_len};
+            if (pthread_create(&threads[t], NULL, frame_process, &works[t]) != 0) {
+                handle_error("Failed to create thread", -1);
+            }
+        }
+        for (int t = 0; t < n; t++) {
+            pthread_join(threads[t], NULL);
+        }
+
+        for (size_t f = 0; f < num_frames; f++) {
+            Frame *frame = &frames[f];
+            if (!frame->ok || frame->type > FRAME_ZERO || (frame->type == FRAME_ZERO && frame->body_len != 8)
+                || (frame->type == FRAME_PAIRS && frame->body_len % decoder->pair_len != 0)) {
+                fprintf(stderr, "nyuenc: %s: corrupt frame\n", path);
+                exit(EXIT_FAILURE);
+            }
+            if (frame->type == FRAME_PAIRS) {
+                decode_pairs(decoder, frame->body, frame->body_len);
+            } else if (frame->type == FRAME_HUFFMAN) {
+                decode_pairs(decoder, frame->pairs, frame->len);
+            } else {
+                unsigned char zero[MAX_PAIR_LEN] = {0};
+                decode_run(decoder, zero, get_le(frame->body, 8));
+            }
+        }
+    }
+
+    free(pairs);
+    free(frames);
+}
+
+// Record struct for a record of `--unordered` found by `nyuenc decode`
+typedef struct {
+    uint64_t seq;
+    uint64_t offset;
+    uint64_t input_len;
+    const unsigned char *body;
+    size_t body_len;
+} Record;
+
+// Order records by sequence id for qsort()
+int compare_records(const void *a, const void *b) {
+    const Record *x = a, *y = b;
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+// Decode the records of `--unordered`: collect them, sort them by sequence id (ids of flushes are skipped, so ids
+// may have gaps) and expand them in that order. The input offsets have to follow each other without a gap.
+void decode_records(Decoder *decoder, const char *path, const unsigned char *p, size_t len) {
+    size_t max_records = 4096, num_records = 0;
+    Record *records = malloc(max_records * sizeof(Record));
+    size_t pos = decoder->header.len;
+
+    while (pos < len) {
+        if (len - pos < RECORD_HEAD_LEN || get_le(p + pos + 24, 4) > len - pos - RECORD_HEAD_LEN) {
+            fprintf(stderr, "nyuenc: %s: truncated record\n", path);
+            exit(EXIT_FAILURE);
+        }
+        if (num_records == max_records) {
+            max_records *= 2;
+            records = realloc(records, max_records * sizeof(Record));
+        }
+        Record *record = &records[num_records++];
+        record->seq = get_le(p + pos, 8);
+        record->offset = get_le(p + pos + 8, 8);
+        record->input_len = get_le(p + pos + 16, 8);
+        record->body_len = get_le(p + pos + 24, 4);
+        record->body = p + pos + RECORD_HEAD_LEN;
+        if (record->body_len % decoder->pair_len != 0) {
+            fprintf(stderr, "nyuenc: %s: corrupt record\n", path);
+            exit(EXIT_FAILURE);
+        }
+        pos += RECORD_HEAD_LEN + record->body_len;
+    }
+
+    qsort(records, num_records, sizeof(Record), compare_records);
+
+    uint64_t offset = 0;
+    for (size_t r = 0; r < num_records; r++) {
+        Record *record = &records[r];
+        if (record->offset != offset || (r > 0 && record->seq == records[r - 1].seq)) {
+            fprintf(stderr, "nyuenc: %s: a record is missing or repeated before record %llu (input offset %llu)\n",
+                    path, (unsigned long long)record->seq, (unsigned long long)offset);
+            exit(EXIT_FAILURE);
+        }
+        if (record->body_len > 0) {
+            decode_pairs(decoder, record->body, record->body_len);
+        } else {
+            unsigned char zero[MAX_PAIR_LEN] = {0};
+            decode_run(decoder, zero, record->input_len * 8 / decoder->header.width);
+        }
+        offset += record->input_len;
+    }
+
+    free(records);
+}
+
+// Expand runs of bytes from their columns at their offsets. A short run is one 8-byte store of its byte broadcast,
+// the next run overwrites what is past its end, a longer one a memset() (a vector broadcast in libc).
+void expand_byte_runs(Decoder *decoder, const unsigned char *bytes, const unsigned char *counts, size_t runs) {
+    for (size_t r = 0; r < runs; r++) {
+        if (decoder->n + MAX_CHAR_LEN + 8 > decoder->buffer_len) {
+            flush_decoded(decoder);
+        }
+        if (counts[r] <= 8) {
+            uint64_t fill = bytes[r] * 0x0101010101010101ULL;
+            memcpy(decoder->data + decoder->n, &fill, 8);
+        } else {
+            memset(decoder->data + decoder->n, bytes[r], counts[r]);
+        }
+        decoder->n += counts[r];
+    }
+}
+
+// Decode the blocks of `--columnar`: runs of bytes go through expand_byte_runs(), the pairs of other widths are put
+// back together one at a time
+void decode_columns(Decoder *decoder, const char *path, const unsigned char *p, size_t len) {
+    size_t size = decoder->pair_len - 1;
+    for (size_t pos = decoder->header.len; pos < len;) {
+        if (len - pos < COLUMN_HEAD_LEN || get_le(p + pos, 4) > (len - pos - COLUMN_HEAD_LEN) / decoder->pair_len) {
+            fprintf(stderr, "nyuenc: %s: truncated block at offset %zu\n", path, pos);
+            exit(EXIT_FAILURE);
+        }
+        size_t runs = get_le(p + pos, 4);
+        uint64_t zero_run = get_le(p + pos + 4, 8);
+        const unsigned char *elements = p + pos + COLUMN_HEAD_LEN;
+        const unsigned char *counts = elements + runs * size;
+
+        unsigned char zero[MAX_PAIR_LEN] = {0};
+        decode_run(decoder, zero, zero_run);
+        if (decoder->header.width == 8) {
+            expand_byte_runs(decoder, elements, counts, runs);
+        } else {
+            for (size_t r = 0; r < runs; r++) {
+                unsigned char pair[MAX_PAIR_LEN];
+                memcpy(pair, elements + r * size, size);
+                pair[size] = counts[r];
+                decode_pairs(decoder, pair, decoder->pair_len);
+            }
+        }
+        pos += COLUMN_HEAD_LEN + runs * decoder->pair_len;
+    }
+}
+
+// Frame position of `--crc` found by `nyuenc check`
+typedef struct {
+    size_t pos;
+    uint32_t body_len;
+    uint32_t body_crc;
+} CrcFrame;
+
+// CheckWork struct for the frames checked by one thread of `nyuenc check`
+typedef struct {
+    const unsigned char *p;
+    CrcFrame *frames;
+    size_t num_frames;
+    size_t first;                       // Thread takes frames first, first + step, ...
+    size_t step;
+    size_t bad;                         // First corrupt frame found, num_frames if none
+} CheckWork;
+
+// Read the head of the frame of `--crc` at pos, exit if it does not fit in len
+void read_crc_frame(const char *path, const unsigned char *p, size_t len, size_t pos, uint64_t *input_len,
+                    uint32_t *body_len) {
+    if (len - pos < CRC_HEAD_LEN || get_le(p + pos + 8, 4) > len - pos - CRC_HEAD_LEN) {
+        fprintf(stderr, "nyuenc: %s: truncated frame at offset %zu\n", path, pos);
+        exit(EXIT_FAILURE);
+    }
+    *input_len = get_le(p + pos, 8);
+    *body_len = get_le(p + pos + 8, 4);
+}
+
+// Decode the frames of `--crc` in order, checking the CRC of each body before it is decoded and the CRC of what it
+// decodes to after
+void decode_crc_frames(Decoder *decoder, const char *path, const unsigned char *p, size_t len) {
+    for (size_t pos = decoder->header.len; pos < len;) {
+        uint64_t input_len;
+        uint32_t body_len;
+        read_crc_frame(path, p, len, pos, &input_len, &body_len);
+        const unsigned char *body = p + pos + CRC_HEAD_LEN;
+        if (crc32c(0, body, body_len) != get_le(p + pos + 16, 4) || body_len % decoder->pair_len != 0) {
+            fprintf(stderr, "nyuenc: %s: corrupt frame at offset %zu\n", path, pos);
+            exit(EXIT_FAILURE);
+        }
+
+        decoder->crc = 0;
+        if (body_len > 0) {
+            decode_pairs(decoder, body, body_len);
+        } else {
+            unsigned char zero[MAX_PAIR_LEN] = {0};
+            decode_run(decoder, zero, input_len * 8 / decoder->header.width);
+        }
+        flush_decoded(decoder);
+        if (decoder->crc != get_le(p + pos + 12, 4)) {
+            fprintf(stderr, "nyuenc: %s: frame at offset %zu does not decode to its input\n", path, pos);
+            exit(EXIT_FAILURE);
+        }
+        pos += CRC_HEAD_LEN + body_len;
+    }
+}
+
+// Check the bodies of one thread
+void *check_process(void *args) {
+    CheckWork *work = args;
+    work->bad = work->num_frames;
+    for (size_t f = work->first; f < work->num_frames; f += work->step) {
+        CrcFrame *frame = &work->frames[f];
+        if (crc32c(0, work->p + frame->pos + CRC_HEAD_LEN, frame->body_len) != frame->body_crc) {
+            work->bad = f;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// `nyuenc check`: walk the frame heads of each file of `--crc`, then check the CRC of the bodies over `-j` threads
+// (all CPUs by default). Nothing is decoded, so the CRC of the input is not checked, `nyuenc decode` does that.
+void tool_check(int argc, char **argv, int num_threads) {
+    bool ok = true;
+    for (int arg = optind; arg < argc; arg++) {
+        size_t len;
+        StreamHeader header;
+        const unsigned char *p = map_encoded(argv[arg], &len, &header);
+        if (p != NULL && !header.crc) {
+            fprintf(stderr, "nyuenc: %s: not encoded with --crc, nothing to check\n", argv[arg]);
+            exit(EXIT_FAILURE);
+        }
+
+        size_t max_frames = 4096, num_frames = 0;
+        CrcFrame *frames = malloc(max_frames * sizeof(CrcFrame));
+        for (size_t pos = header.len; pos < len; num_frames++) {
+            uint64_t input_len;
+            uint32_t body_len;
+            read_crc_frame(argv[arg], p, len, pos, &input_len, &body_len);
+            if (num_frames == max_frames) {
+                max_frames *= 2;
+                frames = realloc(frames, max_frames * sizeof(CrcFrame));
+            }
+            frames[num_frames] = (CrcFrame){pos, body_len, get_le(p + pos + 16, 4)};
+            pos += CRC_HEAD_LEN + body_len;
+        }
+
+        int n = (num_threads < (int)num_frames) ? num_threads : (int)num_frames;
+        pthread_t threads[n];
+        CheckWork works[n];
+        for (int t = 0; t < n; t++) {
+            works[t] = (CheckWork){p, frames, num_frames, t, n, num_frames};
+            if (pthread_create(&threads[t], NULL, check_process, &works[t]) != 0) {
+                handle_error("Failed to create thread", -1);
+            }
+        }
+        size_t bad = num_frames;
+        for (int t = 0; t < n; t++) {
+            pthread_join(threads[t], NULL);
+            bad = (works[t].bad < bad) ? works[t].bad : bad;
+        }
+
+        if (bad < num_frames) {
+            fprintf(stderr, "nyuenc: %s: frame %zu at offset %zu is corrupt\n", argv[arg], bad, frames[bad].pos);
+            ok = false;
+        } else {
+            printf("%s: %zu frames ok\n", argv[arg], num_frames);
+        }
+        free(frames);
+        if (p != NULL) {
+            munmap((void *)p, len);
+        }
+    }
+    if (!ok) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+// `nyuenc decode`: expand the pairs of each file into a buffer and undo its filter, the `stride` decoded bytes
+// before the buffer are kept in front of it for the next one. Frames of `--entropy` are decoded over `-j` threads,
+// records of `--unordered` are put back in order first, frames of `--crc` are checked on the way, blocks of
+// `--columnar` are expanded column by column.
+void tool_decode(int argc, char **argv, int num_threads) {
+    if (BASE_PATH != NULL) {
+        open_base(BASE_PATH);
+    }
+
+    Decoder decoder = {0};
+    decoder.buffer_len = 1 << 16;
+    decoder.buffer = malloc(MAX_STRIDE + decoder.buffer_len);
+    decoder.data = decoder.buffer + MAX_STRIDE;
+
+    for (int arg = optind; arg < argc; arg++) {
+        size_t len;
+        const unsigned char *p = map_encoded(argv[arg], &len, &decoder.header);
+        decoder.size = (decoder.header.width == 1) ? 1 : decoder.header.width / 8;
+        decoder.pair_len = (decoder.header.width == 1) ? 2 : decoder.size + 1;
+        decoder.n = 0;
+        decoder.bits = 0;
+        decoder.num_bits = 0;
+        decoder.offset = 0;
+        memset(decoder.buffer, 0, MAX_STRIDE);              // a stream starts after zeros
+
+        if (decoder.header.base != (BASE_PATH != NULL)) {
+            fprintf(stderr, "nyuenc: %s: %s\n", argv[arg], decoder.header.base ? "encoded with --base, give the same base"
+                                                                              : "not encoded with --base");
+            exit(EXIT_FAILURE);
+        }
+        if (decoder.header.entropy) {
+            decode_frames(&decoder, argv[arg], p, len, num_threads);
+        } else if (decoder.header.records) {
+            decode_records(&decoder, argv[arg], p, len);
+        } else if (decoder.header.crc) {
+            decode_crc_frames(&decoder, argv[arg], p, len);
+        } else if (decoder.header.columnar) {
+            decode_columns(&decoder, argv[arg], p, len);
+        } else {
+            decode_pairs(&decoder, p + decoder.header.len, len - decoder.header.len);
+        }
+        flush_decoded(&decoder);
+
+        if (p != NULL) {
+            munmap((void *)p, len);
+        }
+    }
+    free(decoder.buffer);
+}
+
+// Segment struct for whole pairs (or frames) of the output, verified by one verifier thread
+typedef struct Segment {
+    unsigned char *bytes;
+    size_t len;
+    size_t seq;
+    struct Segment *next;
+} Segment;
+
+Segment *VERIFY_HEAD = NULL;            // Queue of segments to verify
+Segment *VERIFY_TAIL = NULL;
+bool VERIFY_DONE = false;               // No more segments
+pthread_mutex_t VERIFY_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t VERIFY_COND = PTHREAD_COND_INITIALIZER;
+sem_t VERIFY_SLOTS;                     // Segments the writer may queue
+size_t VERIFY_NEXT = 0;                 // Sequence of the segment taking its offset next
+uint64_t VERIFY_BITS = 0;               // Offset in bits of the next segment
+StreamHeader VERIFY_HEADER;
+
+// Map every input for `--verify`, and let the writer queue VERIFY_SEGMENTS segments
+void verify_open(int argc, char **argv) {
+    NUM_VERIFY_FILES = argc - optind;
+    VERIFY_FILES = calloc(NUM_VERIFY_FILES, sizeof(VerifyFile));
+    for (int f = 0; f < NUM_VERIFY_FILES; f++) {
+        int fd = open(argv[optind + f], O_RDONLY);
+        struct stat sb;
+        if (fd == -1 || fstat(fd, &sb) == -1) {
+            handle_error("open fd failed", fd);
+        }
+        VERIFY_FILES[f].len = sb.st_size;
+        VERIFY_FILES[f].offset = VERIFY_INPUT_LEN;
+        if (sb.st_size > 0) {
+            VERIFY_FILES[f].addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (VERIFY_FILES[f].addr == MAP_FAILED) {
+                handle_error("map file failed", fd);
+            }
+        }
+        VERIFY_INPUT_LEN += sb.st_size;
+        close(fd);
+    }
+    sem_init(&VERIFY_SLOTS, 0, VERIFY_SEGMENTS);
+}
+
+// Queue a segment of the output, waiting while VERIFY_SEGMENTS are queued
+void verify_queue(Tee *tee, size_t len) {
+    down(&VERIFY_SLOTS);
+
+    Segment *segment = malloc(sizeof(Segment));
+    segment->bytes = malloc(len);
+    memcpy(segment->bytes, tee->pending, len);
+    segment->len = len;
+    segment->seq = tee->seq++;
+    segment->next = NULL;
+    memmove(tee->pending, tee->pending + len, tee->len - len);
+    tee->len -= len;
+
+    pthread_mutex_lock(&VERIFY_MUTEX);
+    if (VERIFY_TAIL == NULL) {
+        VERIFY_HEAD = segment;
+    } else {
+        VERIFY_TAIL->next = segment;
+    }
+    VERIFY_TAIL = segment;
+    pthread_cond_broadcast(&VERIFY_COND);
+    pthread_mutex_unlock(&VERIFY_MUTEX);
+}
+
+// Length of the whole pairs (or frames) at the start of the pending output
+size_t whole_units(Tee *tee) {
+    size_t pair_len = (tee->header.width == 1) ? 2 : tee->header.width / 8 + 1;
+    if (!tee->header.entropy) {
+        return tee->len - tee->len % pair_len;
+    }
+    size_t pos = 0;
+    while (pos + FRAME_HEAD_LEN <= tee->len && pos + FRAME_HEAD_LEN + get_le(tee->pending + pos + 1, 4) <= tee->len) {
+        pos += FRAME_HEAD_LEN + get_le(tee->pending + pos + 1, 4);
+    }
+    return pos;
+}
+
+// Write callback of the output stream of `--verify`: pass to `stdout`, then cut whole segments
+ssize_t tee_write(void *cookie, const char *buf, size_t size) {
+    Tee *tee = cookie;
+    if (fwrite(buf, sizeof(char), size, stdout) != size) {
+        return -1;
+    }
+
+    tee->pending = realloc(tee->pending, tee->len + size);
+    memcpy(tee->pending + tee->len, buf, size);
+    tee->len += size;
+
+    // the header comes first if the output starts with a (0, 0) pair
+    if (!tee->has_header && tee->len >= 2 && (tee->pending[0] != 0 || tee->pending[1] != 0 || tee->len >= HEADER_LEN)) {
+        read_header("output", tee->pending, tee->len, &tee->header);
+        VERIFY_HEADER = tee->header;
+        memmove(tee->pending, tee->pending + tee->header.len, tee->len - tee->header.len);
+        tee->len -= tee->header.len;
+        tee->has_header = true;
+    }
+
+    while (tee->has_header && tee->len >= VERIFY_SEGMENT) {
+        size_t len = whole_units(tee);
+        if (len == 0) {
+            break;
+        }
+        verify_queue(tee, len);
+    }
+    return size;
+}
+
+// Close callback of the output stream of `--verify`: queue the rest and let the verifier threads finish
+int tee_close(void *cookie) {
+    Tee *tee = cookie;
+    if (!tee->has_header && tee->len > 0) {
+        read_header("output", tee->pending, tee->len, &tee->header);
+        VERIFY_HEADER = tee->header;
+        memmove(tee->pending, tee->pending + tee->header.len, tee->len - tee->header.len);
+        tee->len -= tee->header.len;
+        tee->has_header = true;
+    }
+    if (tee->len > 0) {
+        if (whole_units(tee) != tee->len) {
+            verify_failed("output ends inside a pair", VERIFY_INPUT_LEN);
+        }
+        verify_queue(tee, tee->len);
+    }
+    free(tee->pending);
+
+    pthread_mutex_lock(&VERIFY_MUTEX);
+    VERIFY_DONE = true;
+    pthread_cond_broadcast(&VERIFY_COND);
+    pthread_mutex_unlock(&VERIFY_MUTEX);
+    return fflush(stdout);
+}
+
+// The input byte XORed with the base file, as it is after undoing the filter
+unsigned char unfiltered_byte(size_t offset) {
+    return input_byte(offset) ^ ((offset < BASE_LEN) ? BASE[offset] : 0);
+}
+
+// The input byte as encoded, after `--base` and `--filter`
+unsigned char encoded_byte(size_t offset) {
+    unsigned char before = (offset >= STRIDE) ? unfiltered_byte(offset - STRIDE) : 0;
+    if (FILTER == FILTER_DELTA) {
+        return unfiltered_byte(offset) - before;
+    }
+    return (FILTER == FILTER_XOR) ? unfiltered_byte(offset) ^ before : unfiltered_byte(offset);
+}
+
+// Bits of input covered by pairs
+uint64_t pairs_bits(const unsigned char *p, size_t len, size_t pair_len) {
+    uint64_t bits = 0;
+    for (size_t j = 0; j < len; j += pair_len) {
+        unsigned char count = p[j + pair_len - 1];
+        bits += (count == 0 && WIDTH > 8) ? 8 * (uint64_t)p[j] : (uint64_t)count * WIDTH;
+    }
+    return bits;
+}
+
+// Verifier thread: decode segments (Huffman frames first), take their offset in order, expand and compare
+void *verify_process(void *args) {
+    (void)args;
+    Decoder decoder = {0};
+    decoder.buffer_len = 1 << 16;
+    decoder.buffer = malloc(MAX_STRIDE + decoder.buffer_len);
+    decoder.data = decoder.buffer + MAX_STRIDE;
+    decoder.verify = true;
+
+    while (1) {
+        pthread_mutex_lock(&VERIFY_MUTEX);
+        while (VERIFY_HEAD == NULL && !VERIFY_DONE) {
+            pthread_cond_wait(&VERIFY_COND, &VERIFY_MUTEX);
+        }
+        Segment *segment = VERIFY_HEAD;
+        if (segment == NULL) {
+            pthread_mutex_unlock(&VERIFY_MUTEX);
+            break;
+        }
+        VERIFY_HEAD = segment->next;
+        if (VERIFY_HEAD == NULL) {
+            VERIFY_TAIL = NULL;
+        }
+        pthread_mutex_unlock(&VERIFY_MUTEX);
+
+        decoder.header = VERIFY_HEADER;
+        decoder.size = (WIDTH == 1) ? 1 : WIDTH / 8;
+        decoder.pair_len = PAIR_LEN;
+
+        // frames of a segment, Huffman ones decoded to pairs
+        size_t num_frames = 0;
+        Frame *frames = NULL;
+        uint64_t bits = 0;
+        if (decoder.header.entropy) {
+            for (size_t pos = 0; pos < segment->len; num_frames++) {
+                frames = realloc(frames, (num_frames + 1) * sizeof(Frame));
+                Frame *frame = &frames[num_frames];
+                frame->type = segment->bytes[pos];
+                frame->body_len = get_le(segment->bytes + pos + 1, 4);
+                frame->body = segment->bytes + pos + FRAME_HEAD_LEN;
+                frame->pairs = NULL;
+                if (frame->type == FRAME_HUFFMAN) {
+                    frame->len = get_le(frame->body, 4);
+                    frame->pairs = malloc(frame->len);
+                    if (!decode_huffman(frame->body, frame->body_len, frame->pairs, frame->len, PAIR_LEN)) {
+                        verify_failed("corrupt frame", VERIFY_INPUT_LEN);
+                    }
+                    bits += pairs_bits(frame->pairs, frame->len, PAIR_LEN);
+                } else if (frame->type == FRAME_PAIRS) {
+                    bits += pairs_bits(frame->body, frame->body_len, PAIR_LEN);
+                } else {
+                    bits += get_le(frame->body, 8) * WIDTH;
+                }
+                pos += FRAME_HEAD_LEN + frame->body_len;
+            }
+        } else {
+            bits = pairs_bits(segment->bytes, segment->len, PAIR_LEN);
+        }
+
+        // take the offset after the segments before this one
+        pthread_mutex_lock(&VERIFY_MUTEX);
+        while (VERIFY_NEXT != segment->seq) {
+            pthread_cond_wait(&VERIFY_COND, &VERIFY_MUTEX);
+        }
+        uint64_t start = VERIFY_BITS;
+        VERIFY_BITS += bits;
+        VERIFY_NEXT++;
+        pthread_cond_broadcast(&VERIFY_COND);
+        pthread_mutex_unlock(&VERIFY_MUTEX);
+
+        // start from the input: the bytes before for the filter, and the bits of a byte split with the segment before
+        decoder.offset = start / 8;
+        decoder.n = 0;
+        for (size_t k = 0; k < STRIDE; k++) {
+            size_t back = STRIDE - k;
+            decoder.data[(ssize_t)k - (ssize_t)STRIDE] = (decoder.offset >= back) ? unfiltered_byte(decoder.offset - back) : 0;
+        }
+        decoder.num_bits = start % 8;
+        decoder.bits = (decoder.num_bits > 0) ? encoded_byte(decoder.offset) >> (8 - decoder.num_bits) : 0;
+
+        if (decoder.header.entropy) {
+            for (size_t f = 0; f < num_frames; f++) {
+                if (frames[f].type == FRAME_HUFFMAN) {
+                    decode_pairs(&decoder, frames[f].pairs, frames[f].len);
+                    free(frames[f].pairs);
+                } else if (frames[f].type == FRAME_PAIRS) {
+                    decode_pairs(&decoder, frames[f].body, frames[f].body_len);
+                } else {
+                    unsigned char zero[MAX_PAIR_LEN] = {0};
+                    decode_run(&decoder, zero, get_le(frames[f].body, 8));
+                }
+            }
+            free(frames);
+        } else {
+            decode_pairs(&decoder, segment->bytes, segment->len);
+        }
+        flush_decoded(&decoder);
+
+        // the bits of a byte not complete yet are checked here, the next segment starts from the input
+        if (decoder.num_bits > 0 && decoder.bits != (unsigned)(encoded_byte(decoder.offset) >> (8 - decoder.num_bits))) {
+            verify_failed("decoded bit differs", decoder.offset);
+        }
+
+        free(segment->bytes);
+        free(segment);
+        up(&VERIFY_SLOTS);
+    }
+
+    free(decoder.buffer);
+    return NULL;
+}
+
+// Check the whole input was covered once the verifier threads are done
+void verify_finish(pthread_t *threads, int num_threads) {
+    for (int t = 0; t < num_threads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    if (VERIFY_BITS != (uint64_t)VERIFY_INPUT_LEN * 8) {
+        verify_failed("output ends early", VERIFY_BITS / 8);
+    }
+    fprintf(stderr, "nyuenc: verified %zu bytes\n", VERIFY_INPUT_LEN);
+    for (int f = 0; f < NUM_VERIFY_FILES; f++) {
+        if (VERIFY_FILES[f].len > 0) {
+            munmap((void *)VERIFY_FILES[f].addr, VERIFY_FILES[f].len);
+        }
+    }
+    free(VERIFY_FILES);
+}
@@ -1,48 +1,68 @@
-#include <stdio.h>          // stderr, stdout, perror, fwrite, fprintf
-#include <stdlib.h>         // exit, EXIT_FAILURE, EXIT_SUCCESS, malloc
-#include <stdbool.h>        // used for IS_ALL_PROCESSED
-#include <unistd.h>
-
-#include <semaphore.h>      // sem_init, sem_post, sem_wait
-#include <string.h>         // memcpy
-#include <limits.h>         // UINT_MAX
-#include <sys/mman.h>       // mmap
-#include <sys/stat.h>       // fstat
-#include <fcntl.h>          // open, O_*
-#include <pthread.h>        // pthread_t, pthread_create, phthread_exit, pthread_join
-
-
-#define CHUNK_SIZE 4096     // Chunk size set to 4KB (4096 Bytes)
-#define MAX_CHAR_LEN 255    // no character will appear more than 255 times in a row
-#define MAX_FILE_NUM 100    // no more than 100 files
-#define MAX_TASK_NUM 250000 // total size is less than 1GB, 1e6/4 = 250000
-
-
-
-// Task struct for mapped address, start index, end index and id
-typedef struct {
-    const char *addr;
-    size_t start;
-    size_t end;
-    size_t id;
-} Task;
-
-// Result struct for collecting result for each task in buffer with its length
-typedef struct {
-    unsigned char *buffer;              // Result char buffer (e.g. "a1b2c3" char[])
-    size_t len;                         // Length of buffer ("a255b255c255" = 6, )
-} Result;
-
-
-Task* TASK_QUEUE[MAX_TASK_NUM];         // Task queue
-Result* RESULT_QUEUE[MAX_TASK_NUM];     // Result queue
-bool IS_ALL_PROCESSED = false;          // Tracking for if all of tasks are processed
-int SUBMITTED_TASKS = 0;                // Tracking how many tasks are in the task queue
-int PROCESSED_TASKS = 0;                // Tracking task id that has been processed
-
-pthread_mutex_t MUTEX_QUEUE;            // Mutex for queue
-pthread_cond_t COND_QUEUE;              // Condition variable for task queue
-sem_t READY_QUEUE[MAX_TASK_NUM];        // Semaphore for tracking the result is ready to write or not with related id
+#include "nyuenc.h"
+
+
+Task **TASK_QUEUE;                      // Task queue, task with id is at `id % MAX_TASK_NUM`
+Completion *RESULT_QUEUE;               // Result queue, same slot as its task
+Pool POOL;                              // Counters and locks of the task queue
+
+bool FOLLOW = false;                    // `-f`: keep encoding data appended to the inputs
+bool PERF = false;                      // `--perf`: hardware counters per thread and phase
+PerfThread *PERF_THREADS = NULL;        // Counters of each worker, then the writer
+int NUM_PERF_THREADS = 0;
+_Thread_local PerfThread *PERF_SELF = NULL;     // Counters of current thread
+bool LATENCY = false;                   // `--latency[=ms]`: latency histograms per thread
+long LATENCY_INTERVAL_MS = 0;           // Dump the histograms periodically, 0 for only at exit
+LatencyThread *LATENCY_THREADS = NULL;  // Histograms of each worker, then the writer
+int NUM_LATENCY_THREADS = 0;
+_Thread_local LatencyThread *LATENCY_SELF = NULL;   // Histograms of current thread
+bool ANALYZE = false;                   // `--analyze`: run statistics of each input file
+bool ANALYZE_ONLY = false;              // `--analyze-only`: run statistics without writing the output
+size_t SUBMIT_FILE = 0;                 // Index of the input file being submitted, for Task.file
+Analysis **ANALYSIS = NULL;             // Statistics of each worker for each file
+Analysis *JOINED = NULL;                // Runs of each file joined over tasks by the writer
+Analysis JOINED_TOTAL;                  // Runs joined over tasks and files by the writer of a stream
+size_t *NUM_ANALYSIS = NULL;            // Files allocated in ANALYSIS of each worker
+_Thread_local int WORKER_INDEX = -1;    // Index of current worker thread
+const char *SERVE_PATH = NULL;          // Socket path of `--serve`, NULL if not running as a daemon
+const char *APPEND_STATE_PATH = NULL;   // State file of `--append-state`, NULL if encoding from the beginning
+const char *CACHE_PATH = NULL;          // Chunk cache file of `--cache`, NULL if chunk cache is not used
+Cache *CACHE = NULL;                    // Mapped chunk cache file
+size_t CACHE_HITS = 0;                  // Chunks whose pairs came from the chunk cache
+size_t CACHE_LOOKUPS = 0;               // Chunks looked up in the chunk cache
+int FILTER = FILTER_NONE;               // `--filter=delta|xor[:stride]`: pre-filter of the input
+size_t STRIDE = 1;                      // Record length of the filter
+unsigned char STREAM_TAIL[MAX_STRIDE];  // Last MAX_STRIDE bytes of the input submitted so far, for `--filter`
+int WIDTH = 8;                          // `--width=bit|8|16|32|64`: bits of the elements runs are made of
+size_t PAIR_LEN = 2;                    // Bytes of a pair: the element (a byte for `bit`) and its count
+bool ENTROPY = false;                   // `--entropy`: Huffman code the pairs of each task into its own frame
+bool VERIFY = false;                    // `--verify`: decode the output while it is written and compare with the input
+const char *BASE_PATH = NULL;           // `--base file`: XOR the input with this file before encoding
+const unsigned char *BASE = NULL;       // Mapped base file
+size_t BASE_LEN = 0;
+size_t SUBMIT_OFFSET = 0;               // Offset in the input of the next byte submitted, for Task.offset
+const char *BATCH_DIR = NULL;           // `--batch dir`: encode each input to its own file in dir
+BatchFile *SUBMIT_BATCH = NULL;         // Output of the input file being submitted, for Task.batch
+FILE *BATCH_MANIFEST = NULL;            // Manifest of `--batch`, one line for each output as it is closed
+pthread_mutex_t BATCH_MUTEX = PTHREAD_MUTEX_INITIALIZER;    // Mutex for the manifest and giving slots back
+pthread_cond_t BATCH_COND = PTHREAD_COND_INITIALIZER;
+sem_t BATCH_SLOTS;                      // Outputs that may be opened
+size_t BATCH_CLOSED = 0;                // Outputs closed so far
+size_t RETIRED_TASKS = 0;               // Tasks whose slot is given back to POOL.free_slots with `--batch`
+InputSource *INPUT_SOURCES = NULL;      // `-r` and `-@` in the order given, after the files of argv
+int NUM_INPUT_SOURCES = 0;
+unsigned SHARD_INDEX = 0;               // `--shard i/N`: encode the i-th of N ranges of the input
+unsigned SHARD_COUNT = 0;               // 0 without `--shard`
+bool COLUMNAR = false;                  // `--columnar`: each task is a block of its elements, then their counts
+bool CRC = false;                       // `--crc`: each task is a frame with the CRC32C of its input and of its pairs
+bool UNORDERED = false;                 // `--unordered`: workers write each chunk as a record once it is encoded
+pthread_mutex_t RECORD_MUTEX = PTHREAD_MUTEX_INITIALIZER;  // Mutex for writing records to `stdout`
+size_t CHUNK_LEN = 0;                   // `--chunk KB`: bytes of a task of a mapped file, CHUNK_SIZE if not given
+bool TUNE = false;                      // `--tune`: time a sample of the inputs over a grid of `-j` and `--chunk`
+bool JOBS_AUTO = false;                 // `-j auto`: `-j` and `--chunk` of `--tune` for this host and data
+const char *SHM_NAME = NULL;            // `--shm name`: write the output into a shared-memory ring instead of `stdout`
+bool HUGE_PAGES = false;                // `--hugepages[=MB]`: rings and an arena for tasks and results on 2MB pages
+size_t ARENA_LEN = 256 << 20;           // Bytes of the arena
+bool THP_INPUT = false;                 // `--thp-input`: ask for transparent huge pages on the mapped inputs
 
 
 // Semaphore helper function `down`
@@ -64,21 +84,181 @@ void handle_error(const char *message, int fd) {
     exit(EXIT_FAILURE);
 }
 
+// Store a little-endian integer of `len` bytes
+void put_le(unsigned char *p, uint64_t value, size_t len) {
+    for (size_t k = 0; k < len; k++) {
+        p[k] = value >> (8 * k);
+    }
+}
+
+// Load a little-endian integer of `len` bytes
+uint64_t get_le(const unsigned char *p, size_t len) {
+    uint64_t value = 0;
+    for (size_t k = 0; k < len; k++) {
+        value |= (uint64_t)p[k] << (8 * k);
+    }
+    return value;
+}
+
 
 
-// Parsing function that update the number of threads based on `-j jobs`
+// Parse `delta`, `xor`, `delta:4` or `xor:8` of `--filter` into FILTER and STRIDE
+bool parse_filter(const char *arg) {
+    const char *colon = strchr(arg, ':');
+    size_t name_len = (colon != NULL) ? (size_t)(colon - arg) : strlen(arg);
+
+    if (name_len == 5 && strncmp(arg, "delta", 5) == 0) {
+        FILTER = FILTER_DELTA;
+    } else if (name_len == 3 && strncmp(arg, "xor", 3) == 0) {
+        FILTER = FILTER_XOR;
+    } else {
+        return false;
+    }
+
+    STRIDE = (colon != NULL) ? (size_t)atoi(colon + 1) : 1;
+    return STRIDE >= 1 && STRIDE <= MAX_STRIDE;
+}
+
+// Parsing function that update the number of threads based on `-j jobs`, and `--serve path` for the daemon
 int parsing_j(int argc, char **argv) {
     int opt;
     int num_threads = 1;    // for single thread process
 
-    while ((opt = getopt(argc, argv, "j:")) != -1) {
+    static const struct option long_options[] = {
+        {"serve", required_argument, NULL, 's'},
+        {"cache", required_argument, NULL, 'c'},
+        {"append-state", required_argument, NULL, 'a'},
+        {"perf", no_argument, NULL, 'p'},
+        {"latency", optional_argument, NULL, 'l'},
+        {"analyze", no_argument, NULL, 'A'},
+        {"analyze-only", no_argument, NULL, 'O'},
+        {"filter", required_argument, NULL, 'F'},
+        {"width", required_argument, NULL, 'w'},
+        {"entropy", no_argument, NULL, 'e'},
+        {"base", required_argument, NULL, 'b'},
+        {"verify", no_argument, NULL, 'V'},
+        {"batch", required_argument, NULL, 'B'},
+        {"hugepages", optional_argument, NULL, 'H'},
+        {"thp-input", no_argument, NULL, 'T'},
+        {"shard", required_argument, NULL, 'S'},
+        {"unordered", no_argument, NULL, 'u'},
+        {"shm", required_argument, NULL, 'm'},
+        {"chunk", required_argument, NULL, 'k'},
+        {"tune", no_argument, NULL, 't'},
+        {"crc", no_argument, NULL, 'C'},
+        {"columnar", no_argument, NULL, 'L'},
+        {NULL, 0, NULL, 0},
+    };
+
+    INPUT_SOURCES = calloc(argc, sizeof(InputSource));
+    while ((opt = getopt_long(argc, argv, "j:fr:@:", long_options, NULL)) != -1) {
         switch (opt) {
             case 'j':
+                JOBS_AUTO = strcmp(optarg, "auto") == 0;
+                if (JOBS_AUTO) {
+                    break;                  // resolved by main() once the inputs are known
+                }
                 num_threads = atoi(optarg);
                 if (num_threads <= 0) {
                     return EXIT_FAILURE;
                 }
                 break;
+            case 'f':
+                FOLLOW = true;
+                break;
+            case 'r':
+            case '@':
+                INPUT_SOURCES[NUM_INPUT_SOURCES].type = opt;
+                INPUT_SOURCES[NUM_INPUT_SOURCES].arg = optarg;
+                NUM_INPUT_SOURCES++;
+                break;
+            case 's':
+                SERVE_PATH = optarg;
+                break;
+            case 'c':
+                CACHE_PATH = optarg;
+                break;
+            case 'a':
+                APPEND_STATE_PATH = optarg;
+                break;
+            case 'p':
+                PERF = true;
+                break;
+            case 'A':
+                ANALYZE = true;
+                break;
+            case 'O':
+                ANALYZE = true;
+                ANALYZE_ONLY = true;
+                break;
+            case 'F':
+                if (!parse_filter(optarg)) {
+                    fprintf(stderr, "nyuenc: unknown filter %s, expected delta[:stride] or xor[:stride]\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'w':
+                WIDTH = (strcmp(optarg, "bit") == 0) ? 1 : atoi(optarg);
+                if (WIDTH != 1 && WIDTH != 8 && WIDTH != 16 && WIDTH != 32 && WIDTH != 64) {
+                    fprintf(stderr, "nyuenc: unknown width %s, expected bit, 8, 16, 32 or 64\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                PAIR_LEN = (WIDTH == 1) ? 2 : WIDTH / 8 + 1;
+                break;
+            case 'e':
+                ENTROPY = true;
+                break;
+            case 'b':
+                BASE_PATH = optarg;
+                break;
+            case 'V':
+                VERIFY = true;
+                break;
+            case 'B':
+                BATCH_DIR = optarg;
+                break;
+            case 'H':
+                HUGE_PAGES = true;
+                if (optarg != NULL) {
+                    ARENA_LEN = (size_t)atol(optarg) << 20;
+                }
+                break;
+            case 'T':
+                THP_INPUT = true;
+                break;
+            case 'u':
+                UNORDERED = true;
+                break;
+            case 'm':
+                SHM_NAME = optarg;
+                break;
+            case 'k':
+                CHUNK_LEN = (size_t)atol(optarg) << 10;
+                if (CHUNK_LEN == 0 || CHUNK_LEN % CHUNK_SIZE != 0 || CHUNK_LEN > MAX_CHUNK_SIZE) {
+                    fprintf(stderr, "nyuenc: unknown chunk %s, expected KB in multiples of %d up to %d\n", optarg,
+                            CHUNK_SIZE >> 10, MAX_CHUNK_SIZE >> 10);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                TUNE = true;
+                break;
+            case 'C':
+                CRC = true;
+                break;
+            case 'L':
+                COLUMNAR = true;
+                break;
+            case 'S':
+                if (sscanf(optarg, "%u/%u", &SHARD_INDEX, &SHARD_COUNT) != 2 || SHARD_INDEX >= SHARD_COUNT) {
+                    fprintf(stderr, "nyuenc: unknown shard %s, expected i/N with i < N\n", optarg);
+                    exit(EXIT_FAILURE);     // encoding all of the input instead would look like a good shard
+                }
+                break;
+            case 'l':
+                LATENCY = true;
+                LATENCY_INTERVAL_MS = (optarg != NULL) ? atol(optarg) : 0;
+                break;
             default: 
                 return EXIT_FAILURE;
         }
@@ -87,243 +267,3410 @@ int parsing_j(int argc, char **argv) {
     return num_threads;
 }
 
-// Encoder function for each task and return the related result
-Result* encoder(Task *task) {
-    unsigned char current_char = task->addr[task->start];
-    unsigned int count = 0;
-    size_t len = 0;
+/* Huge pages: at high `-j` the rings and the many small tasks and results spread over many 4KB pages and miss the dTLB.
+   `--hugepages` maps the rings on 2MB pages, and tasks and results come from an arena of 2MB blocks: each thread
+   bumps through its own block, a block counts its live allocations (plus one while its thread still allocates from
+   it) and goes back to the free blocks with the last free, whatever the order of frees. MAP_HUGETLB needs pages
+   reserved in /proc/sys/vm/nr_hugepages, without them the memory is asked for transparent huge pages instead.
+   When the arena has no free block, allocations fall back to malloc(). */
+
+char *ARENA = NULL;                     // Blocks of the arena
+ArenaBlock **ARENA_FREE = NULL;         // Stack of free blocks
+size_t NUM_ARENA_FREE = 0;
+pthread_mutex_t ARENA_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+_Thread_local ArenaBlock *ARENA_SELF = NULL;    // Block current thread allocates from
+
+// Map zeroed memory on 2MB pages, with MAP_HUGETLB if pages are reserved or else madvise(MADV_HUGEPAGE)
+void *huge_map(size_t len) {
+    len = (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) {
+        return p;
+    }
 
-    Result *result = malloc(sizeof(Result));
+    // transparent huge pages need 2MB aligned memory, map more and cut the ends
+    char *q = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (q == MAP_FAILED) {
+        handle_error("map huge pages failed", -1);
+    }
+    char *aligned = (char *)(((uintptr_t)q + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+    if (aligned > q) {
+        munmap(q, aligned - q);
+    }
+    munmap(aligned + len, q + HUGE_PAGE_SIZE - aligned);
+    madvise(aligned, len, MADV_HUGEPAGE);
+    return aligned;
+}
 
-    // create a temporary buffer for later copying to the related result buffer
-    unsigned char temp_buffer[(task->end - task->start) * 2];
+// Allocate `n` zeroed entries starting on a cache line, free with free()
+void *line_alloc(size_t n, size_t size) {
+    size_t len = (n * size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    void *entries = aligned_alloc(CACHE_LINE, len);
+    if (entries == NULL) {
+        handle_error("aligned_alloc failed", -1);
+    }
+    return memset(entries, 0, len);
+}
 
-    for (size_t i = task->start; i < task->end; i++) {
-        if (task->addr[i] == current_char && count < MAX_CHAR_LEN) {
-            count++;
+// Allocate zeroed rings of `n` entries on their own pages, so slots start on a cache line, on 2MB pages with
+// `--hugepages`
+void *ring_alloc(size_t n, size_t size) {
+    if (HUGE_PAGES) {
+        return huge_map(n * size);
+    }
+    void *ring = mmap(NULL, n * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        handle_error("map rings failed", -1);
+    }
+    return ring;
+}
+
+// Allocate TASK_QUEUE and RESULT_QUEUE
+void open_rings() {
+    TASK_QUEUE = ring_alloc(MAX_TASK_NUM, sizeof(Task *));
+    RESULT_QUEUE = ring_alloc(MAX_TASK_NUM, sizeof(Completion));
+}
+
+// Map the arena of `--hugepages`, all blocks are free
+void open_arena() {
+    size_t num_blocks = ARENA_LEN / HUGE_PAGE_SIZE;
+    if (num_blocks == 0) {
+        return;
+    }
+    ARENA = huge_map(num_blocks * HUGE_PAGE_SIZE);
+    ARENA_FREE = malloc(num_blocks * sizeof(ArenaBlock *));
+    for (size_t b = 0; b < num_blocks; b++) {
+        ARENA_FREE[NUM_ARENA_FREE++] = (ArenaBlock *)(ARENA + (num_blocks - 1 - b) * HUGE_PAGE_SIZE);
+    }
+}
+
+// Drop a reference to a block, it is free again with the last one
+void arena_put(ArenaBlock *block) {
+    if (__atomic_sub_fetch(&block->live, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_lock(&ARENA_MUTEX);
+        ARENA_FREE[NUM_ARENA_FREE++] = block;
+        pthread_mutex_unlock(&ARENA_MUTEX);
+    }
+}
+
+// Allocate from the block of current thread, taking a free block when it is full. Plain malloc() without
+// `--hugepages`, or when the arena has no free block.
+void *arena_alloc(size_t len) {
+    if (ARENA == NULL || len > HUGE_PAGE_SIZE - ARENA_HEADER) {
+        return malloc(len);
+    }
+    len = (len + 15) / 16 * 16;
+
+    if (ARENA_SELF == NULL || ARENA_SELF->used + len > HUGE_PAGE_SIZE) {
+        if (ARENA_SELF != NULL) {
+            arena_put(ARENA_SELF);
+        }
+        pthread_mutex_lock(&ARENA_MUTEX);
+        ARENA_SELF = (NUM_ARENA_FREE > 0) ? ARENA_FREE[--NUM_ARENA_FREE] : NULL;
+        pthread_mutex_unlock(&ARENA_MUTEX);
+        if (ARENA_SELF == NULL) {
+            return malloc(len);
+        }
+        ARENA_SELF->live = 1;
+        ARENA_SELF->used = ARENA_HEADER;
+    }
+
+    void *p = (char *)ARENA_SELF + ARENA_SELF->used;
+    ARENA_SELF->used += len;
+    __atomic_add_fetch(&ARENA_SELF->live, 1, __ATOMIC_RELAXED);
+    return p;
+}
+
+// Allocate zeroed memory from the arena
+void *arena_calloc(size_t len) {
+    void *p = arena_alloc(len);
+    memset(p, 0, len);
+    return p;
+}
+
+// Free memory of arena_alloc(), from any thread
+void arena_free(void *p) {
+    char *c = p;
+    if (ARENA != NULL && c >= ARENA && c < ARENA + ARENA_LEN / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE) {
+        arena_put((ArenaBlock *)(ARENA + (size_t)(c - ARENA) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE));
+    } else {
+        free(p);
+    }
+}
+
+/* Run statistics: with `--analyze`, encoder() counts the pairs it writes into the Analysis of current worker for the
+   file of the task. Work is per pair rather than per byte, so it stays cheap. The first and last run of a task may
+   go on in the tasks next to it, so the worker keeps them in the result, and the writer joins them in order with
+   analyze_join(). Runs and pairs are then those of the output. The other runs are counted after the encoding loop
+   from its columns, a run of one pair only adds to short_runs by its length. */
+
+// Statistics of current worker for a file
+Analysis *analysis_for(size_t file) {
+    Analysis **files = &ANALYSIS[WORKER_INDEX];
+    size_t *num = &NUM_ANALYSIS[WORKER_INDEX];
+
+    if (file >= *num) {
+        size_t grow = (file + 1) * 2;
+        *files = realloc(*files, grow * sizeof(Analysis));
+        memset(*files + *num, 0, (grow - *num) * sizeof(Analysis));
+        *num = grow;
+    }
+    return &(*files)[file];
+}
+
+// Count a run that ended: its length, and its pairs of at most MAX_CHAR_LEN
+void count_run(Analysis *stats, uint64_t run) {
+    int bucket = 63 - __builtin_clzll(run);
+    stats->runs[bucket < RUN_BUCKETS ? bucket : RUN_BUCKETS - 1]++;
+    stats->num_runs++;
+    stats->pairs += (run + MAX_CHAR_LEN - 1) / MAX_CHAR_LEN;
+    if (run > stats->longest) {
+        stats->longest = run;
+    }
+}
+
+// Count the runs of a task from its columns of chars and counts (step bytes apart), the first and last run go into
+// the result for the writer to join with the tasks next to it
+void analyze_runs(Analysis *stats, Result *result, const unsigned char *chars, const unsigned char *counts,
+                  size_t runs, size_t step) {
+    // a run longer than MAX_CHAR_LEN is pairs of the same char, only the last one is shorter
+    size_t first = 0, last = runs - 1;
+    uint64_t run = 0;
+    do {
+        stats->hist[chars[first * step]] += counts[first * step];
+        run += counts[first * step];
+        first++;
+    } while (first < runs && chars[first * step] == chars[(first - 1) * step]);
+    result->head_char = chars[0];
+    result->head_run = run;
+    if (first == runs) {
+        return;
+    }
+
+    run = 0;
+    while (1) {
+        stats->hist[chars[last * step]] += counts[last * step];
+        run += counts[last * step];
+        if (last == first || chars[(last - 1) * step] != chars[last * step]) {
+            break;
+        }
+        last--;
+    }
+    result->tail_char = chars[last * step];
+    result->tail_run = run;
+
+    run = 0;
+    for (size_t r = first; r < last; r++) {
+        unsigned char count = counts[r * step];
+        stats->hist[chars[r * step]] += count;
+        if (run == 0 && count < MAX_CHAR_LEN) {
+            stats->short_runs[count]++;
+        } else if (chars[(r + 1) * step] == chars[r * step]) {
+            run += count;
         } else {
-            temp_buffer[len] = current_char;
-            temp_buffer[len + 1] = (char)count;
-            len +=2;
-            current_char = task->addr[i];
-            count = 1;
+            count_run(stats, run + count);
+            run = 0;
         }
     }
-    
-    // handle last char in the task
-    temp_buffer[len] = current_char;
-    temp_buffer[len + 1] = (char)count;
-    len +=2;
+}
 
-    result->buffer = malloc(len);
-    result->len = len;
+// Count the pairs of a result that did not come from encoder() (chunk cache)
+void analyze_result(Analysis *stats, Result *result) {
+    if (result->len > 0) {
+        analyze_runs(stats, result, result->buffer, result->buffer + 1, result->len / 2, 2);
+    }
+}
+
+// End the run the writer is joining, in its file and in the total of the stream (which `--batch` does not have)
+void analyze_end(Writer *writer) {
+    if (writer->analyze_run > 0) {
+        count_run(&JOINED[writer->analyze_file], writer->analyze_run);
+        writer->analyze_run = 0;
+    }
+    if (writer->analyze_total > 0 && BATCH_DIR == NULL) {
+        count_run(&JOINED_TOTAL, writer->analyze_total);
+    }
+    writer->analyze_total = 0;
+}
+
+// Join the first and last run of a result with the runs before it, in order of tasks. A run going on into the next
+// file ends in its file, but is still one run of the stream.
+void analyze_join(Writer *writer, Task *task, Result *result) {
+    if (task->file != writer->analyze_file) {
+        if (writer->analyze_run > 0) {
+            count_run(&JOINED[writer->analyze_file], writer->analyze_run);
+            writer->analyze_run = 0;
+        }
+        writer->analyze_file = task->file;
+    }
+
+    if (writer->analyze_total > 0 && writer->analyze_char == result->head_char) {
+        writer->analyze_run += result->head_run;
+        writer->analyze_total += result->head_run;
+    } else {
+        analyze_end(writer);
+        writer->analyze_char = result->head_char;
+        writer->analyze_run = writer->analyze_total = result->head_run;
+    }
 
-    // copy temp_buffer to result buffer
-    memcpy(result->buffer, temp_buffer,len);
+    if (result->tail_run > 0) {
+        analyze_end(writer);
+        writer->analyze_char = result->tail_char;
+        writer->analyze_run = writer->analyze_total = result->tail_run;
+    }
+}
 
+/* Columnar layout: with `--columnar` the pairs of a task are written as a block `<runs, hole length>` (little endian,
+   4 and 8 bytes), then the elements (bytes, or bits of `--width=bit`) of its runs, then their counts, so each stream
+   holds one kind of value. encoder() writes the two columns directly, the pairs of the other encoders are split when
+   they are copied into the result. A hole is a block with no runs. Blocks are not merged with each other.
+   `nyuenc decode` expands the runs of bytes straight from the two columns, with no pair to take apart. */
+
+// Make the result a block from the columns of elements and counts of its runs
+Result* finish_columns(Result *result, const unsigned char *elements, const unsigned char *counts, size_t runs,
+                       uint64_t zero_run) {
+    size_t size = PAIR_LEN - 1;
+    result->len = COLUMN_HEAD_LEN + runs * PAIR_LEN;
+    result->buffer = arena_alloc(result->len);
+    result->zero_run = 0;
+    put_le(result->buffer, runs, 4);
+    put_le(result->buffer + 4, zero_run, 8);
+    if (runs > 0) {
+        memcpy(result->buffer + COLUMN_HEAD_LEN, elements, runs * size);
+        memcpy(result->buffer + COLUMN_HEAD_LEN + runs * size, counts, runs);
+    }
     return result;
 }
 
-// Write and merge results in RESULT_QUEUE parallelly using READY_QUEUE to the `stdout` 
-void write_result() {
-    unsigned char current_char = '\0';
-    unsigned int current_count = 0;
-    int i = 0;
+/* Element widths: `--width=16|32|64` finds runs of whole 2, 4 or 8-byte elements and writes `<element, count>` pairs
+   of 3, 5 or 9 bytes, `--width=bit` finds runs of bits (most significant first) and writes `<bit, count>` pairs.
+   A task is split into elements from its start, tasks start at multiples of CHUNK_SIZE so they stay aligned.
+   The bytes after the last whole element of a task are written as a trailer pair `<length, bytes..., 0>`,
+   a count of 0 never appears otherwise. */
+
+typedef unsigned char v32u8 __attribute__((vector_size(32)));
+
+// Check if the 32 bytes at p equal the 32 bytes at q
+bool same_block(const unsigned char *p, const unsigned char *q) {
+    v32u8 a, b;
+    memcpy(&a, p, sizeof(a));
+    memcpy(&b, q, sizeof(b));
+    v32u8 ne = (v32u8)(a != b);
+    uint64_t lanes[4];
+    memcpy(lanes, &ne, sizeof(lanes));
+    return (lanes[0] | lanes[1] | lanes[2] | lanes[3]) == 0;
+}
 
-    while (1) {
-        // wait for the result to be ready
-        down(&READY_QUEUE[i]);
+// Write a run of an element as pairs of at most MAX_CHAR_LEN, return the new length of out
+size_t emit_run(unsigned char *out, size_t len, const unsigned char *element, size_t element_len, size_t run) {
+    while (run > 0) {
+        size_t count = (run > MAX_CHAR_LEN) ? MAX_CHAR_LEN : run;
+        memcpy(out + len, element, element_len);
+        out[len + element_len] = (unsigned char)count;
+        len += element_len + 1;
+        run -= count;
+    }
+    return len;
+}
 
-        // handle the termination signal
-        if (RESULT_QUEUE[i] == NULL || RESULT_QUEUE[i]->len == UINT_MAX) {
-            break;
+// Copy the pairs of a task into its result, split into the columns of a block with `--columnar`
+Result* finish_result(Result *result, const unsigned char *pairs, size_t len) {
+    if (COLUMNAR) {
+        size_t runs = len / PAIR_LEN, size = PAIR_LEN - 1;
+        result->len = COLUMN_HEAD_LEN + len;
+        result->buffer = arena_alloc(result->len);
+        put_le(result->buffer, runs, 4);
+        put_le(result->buffer + 4, 0, 8);
+        unsigned char *elements = result->buffer + COLUMN_HEAD_LEN;
+        unsigned char *counts = elements + runs * size;
+        for (size_t r = 0; r < runs; r++) {
+            memcpy(elements + r * size, pairs + r * PAIR_LEN, size);
+            counts[r] = pairs[r * PAIR_LEN + size];
         }
+        return result;
+    }
+
+    result->buffer = arena_alloc(len);
+    result->len = len;
+    memcpy(result->buffer, pairs, len);
+    return result;
+}
 
-        Result *result = RESULT_QUEUE[i];
+// Encode a task as runs of 2, 4 or 8-byte elements. An element repeats while the bytes equal the bytes one element
+// before, so 32 bytes are compared at a time against themselves shifted by one element.
+Result* element_encoder(Task *task, Result *result) {
+    const unsigned char *p = (const unsigned char *)task->addr + task->start;
+    size_t size = WIDTH / 8;
+    size_t n = (task->end - task->start) / size;
+    size_t tail = (task->end - task->start) % size;
+    unsigned char temp_buffer[(n + 1) * PAIR_LEN];
+    size_t len = 0;
 
-        for (size_t j = 0; j < result->len; j += 2) {
-            unsigned char result_char = result->buffer[j];
-            unsigned char result_count = result->buffer[j + 1];
+    for (size_t i = 0; i < n;) {
+        size_t k = i + 1;
+        while (k * size + 32 <= n * size && same_block(p + k * size, p + (k - 1) * size)) {
+            k += 32 / size;
+        }
+        while (k < n && memcmp(p + k * size, p + (k - 1) * size, size) == 0) {
+            k++;
+        }
+        len = emit_run(temp_buffer, len, p + i * size, size, k - i);
+        i = k;
+    }
 
-            if (result_char == current_char) {
-                current_count += result_count;
+    if (tail > 0) {
+        temp_buffer[len] = (unsigned char)tail;
+        memcpy(temp_buffer + len + 1, p + n * size, tail);
+        memset(temp_buffer + len + 1 + tail, 0, size - tail);
+        len += PAIR_LEN;
+    }
+    return finish_result(result, temp_buffer, len);
+}
 
-                // split it into multiple entries if the count exceeds MAX_CHAR_LEN
-                while (current_count > MAX_CHAR_LEN) {
-                    fwrite(&current_char, sizeof(unsigned char), 1, stdout);
-                    unsigned char max_count = MAX_CHAR_LEN;
-                    fwrite(&max_count, sizeof(unsigned char), 1, stdout);
-                    current_count -= MAX_CHAR_LEN;
-                }
-            } else {
+// Encode a task as runs of bits. Bytes of all 0 or all 1 continue a run 8 bits at once, 256 bits for 32 such bytes.
+// Pairs take up to 16 bytes for each byte of the task, 1MB for a chunk of `--chunk 64`, so each worker allocates
+// its buffer once on the heap instead of on its stack.
+Result* bit_encoder(Task *task, Result *result) {
+    static _Thread_local unsigned char *temp_buffer = NULL;
+    const unsigned char *p = (const unsigned char *)task->addr + task->start;
+    size_t n = task->end - task->start;
+    size_t len = 0;
+    if (temp_buffer == NULL) {
+        temp_buffer = malloc(MAX_CHUNK_SIZE * 16);
+    }
 
-                // write the previous char and count, update current char and count
-                if (current_count > 0) {
-                    fwrite(&current_char, sizeof(unsigned char), 1, stdout);
-                    fwrite(&current_count, sizeof(unsigned char), 1, stdout);
-                }
-                current_char = result_char;
-                current_count = result_count;
+    unsigned char bit = p[0] >> 7;
+    size_t run = 0;
+    unsigned char fill_bytes[32];
+    for (size_t i = 0; i < n;) {
+        unsigned char fill = bit ? 0xFF : 0x00;
+        if (p[i] == fill) {
+            memset(fill_bytes, fill, sizeof(fill_bytes));
+            while (i + 32 <= n && same_block(p + i, fill_bytes)) {
+                run += 256;
+                i += 32;
             }
+            while (i < n && p[i] == fill) {
+                run += 8;
+                i++;
+            }
+            continue;
         }
 
+        for (int b = 7; b >= 0; b--) {
+            unsigned char next = (p[i] >> b) & 1;
+            if (next != bit) {
+                len = emit_run(temp_buffer, len, &bit, 1, run);
+                bit = next;
+                run = 0;
+            }
+            run++;
+        }
         i++;
     }
+    len = emit_run(temp_buffer, len, &bit, 1, run);
+    return finish_result(result, temp_buffer, len);
+}
 
-    // write any remaining char and count
-    if (current_count > 0) {
-        fwrite(&current_char, sizeof(unsigned char), 1, stdout);
-        fwrite(&current_count, sizeof(unsigned char), 1, stdout);
+// Encoder function for each task and return the related result
+Result* encoder(Task *task) {
+    Result *result = arena_calloc(sizeof(Result));
+    Analysis *stats = ANALYZE ? analysis_for(task->file) : NULL;
+
+    // a hole is a single run of '\0', no need to read (and fault in) its pages
+    if (task->addr == NULL) {
+        result->buffer = NULL;
+        result->len = 0;
+        result->zero_run = (task->end - task->start) * 8 / WIDTH;
+        if (stats != NULL) {
+            stats->hist['\0'] += result->zero_run;
+            result->head_run = result->zero_run;
+        }
+        return COLUMNAR ? finish_columns(result, NULL, NULL, 0, result->zero_run) : result;
     }
-}
 
+    if (WIDTH == 1) {
+        return bit_encoder(task, result);
+    }
+    if (WIDTH != 8) {
+        return element_encoder(task, result);
+    }
 
+    // bytes are compared unsigned, as a (signed) char a byte of 0x80 or more never equals current_char
+    const unsigned char *addr = (const unsigned char *)task->addr;
+    unsigned char current_char = addr[task->start];
+    unsigned int count = 0;
+    size_t runs = 0;
 
-/* The idea of creating threads pool is from: [Thread Pools in C (using the PTHREAD API)](https://www.youtube.com/watch?v=_n2hE2gyPxU) */
+    // create temporary columns of chars and counts for later copying to the related result buffer
+    unsigned char chars[task->end - task->start];
+    unsigned char counts[task->end - task->start];
 
-// Submit tasks to TASK_QUEUE, update the SUBMITTED_TASKS and signal wake up threads to take task from TASK_QUEUE
-void task_submission(Task* task) {
-    pthread_mutex_lock(&MUTEX_QUEUE);
-    TASK_QUEUE[SUBMITTED_TASKS] = task;
-    SUBMITTED_TASKS++;
-    pthread_cond_signal(&COND_QUEUE);
-    pthread_mutex_unlock(&MUTEX_QUEUE);
-}
+    for (size_t i = task->start; i < task->end; i++) {
+        if (addr[i] == current_char && count < MAX_CHAR_LEN) {
+            count++;
+        } else {
+            chars[runs] = current_char;
+            counts[runs] = (unsigned char)count;
+            runs++;
+            current_char = addr[i];
+            count = 1;
+        }
+    }
+    
+    // handle last char in the task
+    chars[runs] = current_char;
+    counts[runs] = (unsigned char)count;
+    runs++;
+    if (stats != NULL) {
+        analyze_runs(stats, result, chars, counts, runs, 1);
+    }
 
-// Worker threads process
-void *thread_process(void *args) {
-    (void)args;
+    if (COLUMNAR) {
+        return finish_columns(result, chars, counts, runs, 0);
+    }
 
-    while (1) {
-        // lock the TASK_QUEUE
-        pthread_mutex_lock(&MUTEX_QUEUE);
+    // interleave the columns into `<char, count>` pairs of the result buffer
+    result->buffer = arena_alloc(runs * 2);
+    result->len = runs * 2;
+    for (size_t r = 0; r < runs; r++) {
+        result->buffer[2 * r] = chars[r];
+        result->buffer[2 * r + 1] = counts[r];
+    }
 
-        // wait for task when there is no unprocessed task in TASK_QUEUE and all the tasks are not processed yet
-        while (SUBMITTED_TASKS <= PROCESSED_TASKS && !IS_ALL_PROCESSED) {
-            pthread_cond_wait(&COND_QUEUE, &MUTEX_QUEUE);
-        }
-
-        Task task = *TASK_QUEUE[PROCESSED_TASKS];        
-
-        // detect if the task is a poison task
-        if (task.start == UINT_MAX && task.end == UINT_MAX) {
-            // create poison results
-            Result *result = malloc(sizeof(Result));
-            result->buffer = NULL;
-            result->len = UINT_MAX;
-            RESULT_QUEUE[task.id] = result;     // at this time PROCESSED_TASKS = SUBMITTED_TASKS
-            IS_ALL_PROCESSED = true;            // inform all the tasks are processed
-            pthread_cond_signal(&COND_QUEUE);
-            up(&READY_QUEUE[task.id]);          // inform this task is ready to write
-            pthread_mutex_unlock(&MUTEX_QUEUE);
+    return result;
+}
+
+/* Hardware counters: `--perf` opens a perf_event_open group per thread and samples it around encoding, the wait on
+   POOL.cond and the merge loop of the writer. Every call site checks PERF first, so there is no cost without it. */
+
+// Open the counters for current thread, a thread without counters (no PMU, perf_event_paranoid) just skips them
+void perf_attach(PerfThread *perf) {
+    static const struct { uint32_t type; uint64_t config; } events[PERF_EVENTS] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                             | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    };
+
+    perf->leader = -1;
+    int nr = 0;
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[e].type;
+        attr.config = events[e].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        perf->fds[e] = syscall(SYS_perf_event_open, &attr, 0, -1, perf->leader, PERF_FLAG_FD_CLOEXEC);
+        perf->index[e] = (perf->fds[e] == -1) ? -1 : nr++;
+        if (e == 0 && perf->fds[e] == -1) {
             break;
         }
+        if (e == 0) {
+            perf->leader = perf->fds[e];
+        }
+    }
+    PERF_SELF = perf;
+}
 
-        // update the PROCESSED_TASKS and unlock the TASK_QUEUE
-        PROCESSED_TASKS++;
-        pthread_mutex_unlock(&MUTEX_QUEUE);
+// Close the counters of current thread, the totals are kept for the report
+void perf_detach() {
+    for (int e = 0; PERF_SELF->leader != -1 && e < PERF_EVENTS; e++) {
+        if (PERF_SELF->index[e] != -1) {
+            close(PERF_SELF->fds[e]);
+        }
+    }
+    PERF_SELF = NULL;
+}
 
-        Result* result = encoder(&task);
-        RESULT_QUEUE[task.id] = result;
-        up(&READY_QUEUE[task.id]);              // inform this task is ready to write
+// Read the counters of current thread
+void perf_read(uint64_t *values) {
+    uint64_t buf[1 + PERF_EVENTS] = {0};
+    if (read(PERF_SELF->leader, buf, sizeof(buf)) == -1) {
+        return;
     }
+    for (int e = 0; e < PERF_EVENTS; e++) {
+        values[e] = (PERF_SELF->index[e] == -1) ? 0 : buf[1 + PERF_SELF->index[e]];
+    }
+}
 
-    return NULL;
+// Begin a phase of current thread
+void perf_begin() {
+    if (PERF_SELF != NULL && PERF_SELF->leader != -1) {
+        perf_read(PERF_SELF->start);
+    }
 }
 
-// Read files and submit tasks
-void create_tasks_from_file(int argc, char **argv) {
-    size_t id = 0;
-    for (int arg = optind; arg < argc; arg++) {
-        int fd = open(argv[arg], O_RDONLY);
-        if (fd == -1) {
-            handle_error("open fd failed", -1);
+// End a phase of current thread that passed `bytes` of input, add the counters to the phase
+void perf_end(int phase, size_t bytes) {
+    if (PERF_SELF != NULL && PERF_SELF->leader != -1) {
+        uint64_t now[PERF_EVENTS] = {0};
+        perf_read(now);
+        for (int e = 0; e < PERF_EVENTS; e++) {
+            PERF_SELF->total[phase][e] += now[e] - PERF_SELF->start[e];
         }
+        PERF_SELF->bytes[phase] += bytes;
+    }
+}
 
-        struct stat sb;
-        if (fstat(fd, &sb) == -1) {
-            handle_error("get size failed", fd);
-        }
+// Report IPC and misses per KB of input for each phase, summed over threads and for each thread
+void report_perf(int num_threads) {
+    static const char *phases[PERF_PHASES] = {"encode", "wait", "merge"};
 
-        char *addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-        if (addr == MAP_FAILED) { 
-            handle_error("map file failed", fd);
-        }
+    if (PERF_THREADS[0].leader == -1 && PERF_THREADS[num_threads].leader == -1) {
+        fprintf(stderr, "nyuenc: --perf: hardware counters are not available\n");
+        return;
+    }
 
-        // for each file we segment by CHUNK_SIZE(4KB) and assign it to tasks
-        for (size_t size = 0; size < (size_t)sb.st_size; size+=CHUNK_SIZE) {
-            Task *task = malloc(sizeof(Task));
-            task->addr = addr;
-            task->start = size; 
-            task->end = (size + CHUNK_SIZE > (size_t)sb.st_size) ? (size_t)sb.st_size : size + CHUNK_SIZE;
-            task->id = id;
-            id++;
+    fprintf(stderr, "nyuenc: %-10s %-7s %14s %14s %6s %12s %12s %12s\n", "thread", "phase", "cycles",
+            "instructions", "IPC", "br-miss/KB", "LLC-miss/KB", "dTLB-miss/KB");
+    for (int t = -1; t <= num_threads; t++) {
+        for (int phase = 0; phase < PERF_PHASES; phase++) {
+            uint64_t total[PERF_EVENTS] = {0};
+            uint64_t bytes = 0;
+            for (int u = 0; u <= num_threads; u++) {
+                if (t == -1 || t == u) {
+                    for (int e = 0; e < PERF_EVENTS; e++) {
+                        total[e] += PERF_THREADS[u].total[phase][e];
+                    }
+                    bytes += PERF_THREADS[u].bytes[phase];
+                }
+            }
+            if (total[0] == 0) {
+                continue;
+            }
 
-            task_submission(task);
+            char name[24];
+            if (t == -1) {
+                snprintf(name, sizeof(name), "all");
+            } else if (t == num_threads) {
+                snprintf(name, sizeof(name), "writer");
+            } else {
+                snprintf(name, sizeof(name), "worker %d", t);
+            }
+            double kb = bytes ? bytes / 1024.0 : 1.0;
+            fprintf(stderr, "nyuenc: %-10s %-7s %14llu %14llu %6.2f %12.3f %12.3f %12.3f\n", name, phases[phase],
+                    (unsigned long long)total[0], (unsigned long long)total[1], (double)total[1] / total[0],
+                    total[2] / kb, total[3] / kb, total[4] / kb);
         }
+    }
+}
 
-        // munmap(addr, sb.st_size);
-        close(fd);
+
+
+/* Latency histograms: `--latency` records encode time, queue wait and ordering delay of each task into histograms
+   owned by each thread (one writer per histogram, relaxed atomics for readers), so recording takes no lock.
+   Percentiles are merged over threads at exit, or every `--latency=ms` for long streaming runs. */
+
+// Monotonic time in nanoseconds
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Bucket of a value: exact below 2^HIST_SUB_BITS, then 2^HIST_SUB_BITS sub-buckets for each power of 2
+int hist_index(uint64_t v) {
+    if (v < (1 << HIST_SUB_BITS)) {
+        return v;
     }
+    int e = 63 - __builtin_clzll(v);
+    return (e - HIST_SUB_BITS + 1) * (1 << HIST_SUB_BITS) + ((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
 
-    // create a poison task at the end of task queue to inform there is no task and will not be more tasks in TASK_QUEUE
-    Task *poison_pill = malloc(sizeof(Task));
-    poison_pill->addr = NULL;
-    poison_pill->start = UINT_MAX;
-    poison_pill->end = UINT_MAX;
-    poison_pill->id = id++;
-    task_submission(poison_pill);
+// Highest value of a bucket
+uint64_t hist_value(int index) {
+    if (index < (1 << HIST_SUB_BITS)) {
+        return index;
+    }
+    int e = index / (1 << HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t m = index % (1 << HIST_SUB_BITS) + (1 << HIST_SUB_BITS);
+    return ((m + 1) << (e - HIST_SUB_BITS)) - 1;
 }
 
-int main(int argc, char **argv) {
+// Record a latency in a histogram of current thread
+void hist_record(Histogram *hist, uint64_t v) {
+    int index = hist_index(v);
+    __atomic_store_n(&hist->counts[index], hist->counts[index] + 1, __ATOMIC_RELAXED);
+    if (v > hist->max) {
+        __atomic_store_n(&hist->max, v, __ATOMIC_RELAXED);
+    }
+}
 
-    int num_threads = parsing_j(argc, argv);
+// Print p50/p99/p99.9/max of one histogram merged over threads, `offset` picks the histogram in LatencyThread
+void report_histogram(const char *name, size_t offset) {
+    static uint64_t counts[HIST_BUCKETS];
+    uint64_t total = 0, max = 0;
 
-    // initialize mutex and condition variable for task queue
-    pthread_mutex_init(&MUTEX_QUEUE, NULL);
-    pthread_cond_init(&COND_QUEUE, NULL);
+    memset(counts, 0, sizeof(counts));
+    for (int t = 0; t < NUM_LATENCY_THREADS; t++) {
+        Histogram *hist = (Histogram *)((char *)&LATENCY_THREADS[t] + offset);
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            counts[i] += __atomic_load_n(&hist->counts[i], __ATOMIC_RELAXED);
+        }
+        uint64_t hist_max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+        max = (hist_max > max) ? hist_max : max;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        total += counts[i];
+    }
 
-    // initialize each sem in READY_QUEUE
-    for (int i = 0; i < MAX_TASK_NUM; i++) {
-        sem_init(&READY_QUEUE[i], 0, 0);
+    static const double percentiles[3] = {0.5, 0.99, 0.999};
+    uint64_t values[3] = {0};
+    for (int p = 0; p < 3; p++) {
+        uint64_t rank = (uint64_t)(percentiles[p] * total + 0.5), seen = 0;
+        for (int i = 0; i < HIST_BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank && seen > 0) {
+                values[p] = hist_value(i);
+                break;
+            }
+        }
+        values[p] = (values[p] > max) ? max : values[p];
     }
 
-    // initialize threads pool and create threads
-    pthread_t threads[num_threads];
-    for (int i = 0; i < num_threads; i++) {
-        if (pthread_create(&threads[i], NULL, thread_process, NULL) != 0) {
-            handle_error("Failed to create thread", -1);
+    fprintf(stderr, "nyuenc: %-8s %12llu %12.1f %12.1f %12.1f %12.1f\n", name, (unsigned long long)total,
+            values[0] / 1e3, values[1] / 1e3, values[2] / 1e3, max / 1e3);
+}
+
+// Print percentiles of every latency histogram in microseconds
+void report_latency() {
+    fprintf(stderr, "nyuenc: %-8s %12s %12s %12s %12s %12s\n", "latency", "tasks", "p50(us)", "p99(us)",
+            "p99.9(us)", "max(us)");
+    report_histogram("encode", offsetof(LatencyThread, encode));
+    report_histogram("wait", offsetof(LatencyThread, wait));
+    report_histogram("order", offsetof(LatencyThread, order));
+}
+
+bool LATENCY_DONE = false;              // Tells the dump thread to stop
+pthread_mutex_t LATENCY_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t LATENCY_COND = PTHREAD_COND_INITIALIZER;
+
+// Dump thread process for `--latency=ms`, reports the histograms so far every interval
+void *latency_process(void *args) {
+    (void)args;
+
+    pthread_mutex_lock(&LATENCY_MUTEX);
+    while (!LATENCY_DONE) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += LATENCY_INTERVAL_MS / 1000;
+        ts.tv_nsec += (LATENCY_INTERVAL_MS % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&LATENCY_COND, &LATENCY_MUTEX, &ts) != 0 && !LATENCY_DONE) {
+            report_latency();
         }
     }
+    pthread_mutex_unlock(&LATENCY_MUTEX);
+    return NULL;
+}
 
-    create_tasks_from_file(argc, argv);
 
-    write_result();
 
-    // join all worker threads
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+// Read an element of `--width` from a pair, a char for the default width
+uint64_t load_element(const unsigned char *pair) {
+    uint64_t element = 0;
+    for (size_t k = 0; k < PAIR_LEN - 1; k++) {
+        element |= (uint64_t)pair[k] << (8 * k);
     }
+    return element;
+}
 
-    // clean mutex, condition variable and semaphores 
-    pthread_mutex_destroy(&MUTEX_QUEUE);
-    pthread_cond_destroy(&COND_QUEUE);
-    for (int i = 0; i < MAX_TASK_NUM; i++) {
-        sem_destroy(&READY_QUEUE[i]);
+// Store an element of `--width` into a pair
+void store_element(unsigned char *pair, uint64_t element) {
+    for (size_t k = 0; k < PAIR_LEN - 1; k++) {
+        pair[k] = element >> (8 * k);
     }
+}
 
-    // free every task in TASK_QUEUE, every buffer with related result and results in RESULT_QUEUE
-    for (int i = 0; i < MAX_TASK_NUM; i++) {
-        if (TASK_QUEUE[i] != NULL) {
-            free(TASK_QUEUE[i]);
+// Write one `<char, count>` pair to the output of writer
+void write_pair(Writer *writer, uint64_t current_char, size_t current_count) {
+    unsigned char pair[MAX_PAIR_LEN];
+    store_element(pair, current_char);
+    pair[PAIR_LEN - 1] = (unsigned char)current_count;
+    fwrite(pair, sizeof(unsigned char), PAIR_LEN, writer->out);
+    writer->out_len += PAIR_LEN;
+}
+
+// Fill the stream header of `--filter`, `--width`, `--entropy` ('H' for frames instead of 'U'), `--unordered`
+// ('R' for records), `--columnar` ('C' for blocks), `--base` and `--crc` (high bit), a (0, 0) pair can not appear
+// in an encoded stream without it
+void stream_header(unsigned char header[HEADER_LEN]) {
+    unsigned char mode = UNORDERED ? 'R' : ENTROPY ? 'H' : COLUMNAR ? 'C' : 'U';
+    mode |= BASE_PATH != NULL ? 0x20 : 0;       // lower case with `--base`
+    mode |= CRC ? 0x80 : 0;
+    unsigned char fields[HEADER_LEN] = {0, 0, 'N', 'Y', mode, (unsigned char)FILTER, (unsigned char)STRIDE,
+                                        (unsigned char)WIDTH};
+    memcpy(header, fields, HEADER_LEN);
+}
+
+// Write the stream header to the output of writer
+void write_header(Writer *writer) {
+    unsigned char header[HEADER_LEN];
+    stream_header(header);
+    fwrite(header, sizeof(unsigned char), HEADER_LEN, writer->out);
+    writer->out_len += HEADER_LEN;
+}
+
+// Write the pending run as `<char, count>` pairs, keep the last (at most MAX_CHAR_LEN) count pending
+// for merging with the next result. Long runs (e.g. holes) are written in blocks of full pairs.
+void flush_full_pairs(Writer *writer) {
+    static _Thread_local unsigned char block[MAX_PAIR_LEN * CHUNK_SIZE];     // workers write outputs of `--batch`
+
+    while (writer->current_count > MAX_CHAR_LEN) {
+        size_t pairs = (writer->current_count - 1) / MAX_CHAR_LEN;
+        if (pairs > CHUNK_SIZE) {
+            pairs = CHUNK_SIZE;
         }
-        if (RESULT_QUEUE[i] != NULL) {
-            if (RESULT_QUEUE[i]->buffer != NULL) {
-                free(RESULT_QUEUE[i]->buffer);
-            }
-            free(RESULT_QUEUE[i]);
+        for (size_t k = 0; k < pairs; k++) {
+            store_element(block + PAIR_LEN * k, writer->current_char);
+            block[PAIR_LEN * k + PAIR_LEN - 1] = MAX_CHAR_LEN;
         }
+        fwrite(block, sizeof(unsigned char), PAIR_LEN * pairs, writer->out);
+        writer->out_len += PAIR_LEN * pairs;
+        writer->current_count -= pairs * MAX_CHAR_LEN;
+    }
+}
+
+// Merge a run into the pending run of writer, or write the pending run and start a new one
+void merge_run(Writer *writer, uint64_t result_char, size_t result_count) {
+    if (result_char == writer->current_char) {
+        writer->current_count += result_count;
+        writer->run_len += result_count;
+
+        // split it into multiple entries if the count exceeds MAX_CHAR_LEN
+        flush_full_pairs(writer);
+    } else {
+
+        // write the previous char and count, update current char and count
+        if (writer->current_count > 0) {
+            write_pair(writer, writer->current_char, writer->current_count);
+        }
+        if (writer->run_len > 0 && writer->head_count == 0) {
+            writer->head_count = writer->run_len;
+            writer->head_char = writer->current_char;
+        }
+        writer->current_char = result_char;
+        writer->current_count = result_count;
+        writer->run_len = result_count;
+        flush_full_pairs(writer);
+    }
+}
+
+// Merge the pairs of `--width` whole elements, a trailer pair (count 0) ends the pending run and is written as is
+void merge_elements(Writer *writer, Result *result) {
+    for (size_t j = 0; j < result->len; j += PAIR_LEN) {
+        unsigned char count = result->buffer[j + PAIR_LEN - 1];
+        if (count > 0) {
+            merge_run(writer, load_element(result->buffer + j), count);
+            continue;
+        }
+
+        if (writer->current_count > 0) {
+            write_pair(writer, writer->current_char, writer->current_count);
+            writer->current_count = 0;
+        }
+        fwrite(result->buffer + j, sizeof(unsigned char), PAIR_LEN, writer->out);
+        writer->out_len += PAIR_LEN;
+    }
+}
+
+// Drop a reference to a mapping, unmap it with the last one
+void release_mapping(Mapping *map) {
+    if (map != NULL && __atomic_sub_fetch(&map->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        munmap(map->addr, map->len);
+        free(map);
+    }
+}
+
+// Free a written task with its result and give its slot back for the next task
+void free_slot(size_t slot) {
+    Task *task = TASK_QUEUE[slot];
+    Result *result = RESULT_QUEUE[slot].result;
+
+    release_mapping(task->map);
+    free(task->pack);
+    arena_free(task);
+    arena_free(result->buffer);
+    arena_free(result);
+    TASK_QUEUE[slot] = NULL;
+    RESULT_QUEUE[slot].result = NULL;
+
+    if (BATCH_DIR == NULL) {
+        up(&POOL.free_slots);
+        return;
+    }
+
+    // outputs of `--batch` are written out of order, slots still go back in order of id so the rings stay rings
+    pthread_mutex_lock(&BATCH_MUTEX);
+    RESULT_QUEUE[slot].written = true;
+    while (RESULT_QUEUE[RETIRED_TASKS % MAX_TASK_NUM].written) {
+        RESULT_QUEUE[RETIRED_TASKS % MAX_TASK_NUM].written = false;
+        RETIRED_TASKS++;
+        up(&POOL.free_slots);
+    }
+    pthread_mutex_unlock(&BATCH_MUTEX);
+}
+
+// Check if an output starts with the stream header, a plain `<char, count>` stream has none
+bool has_header() {
+    return FILTER != FILTER_NONE || WIDTH != 8 || ENTROPY || BASE_PATH != NULL || UNORDERED || CRC || COLUMNAR;
+}
+
+// Merge the result in slot into the pending run of writer, or write out a frame (or block) as it is
+void merge_result(Writer *writer, size_t slot) {
+    Result *result = RESULT_QUEUE[slot].result;
+
+    if (LATENCY && result->ready_ns != 0) {
+        hist_record(&LATENCY_SELF->order, now_ns() - result->ready_ns);
+    }
+    if (PERF) {
+        perf_begin();
+    }
+    if (ANALYZE && result->head_run > 0) {
+        analyze_join(writer, TASK_QUEUE[slot], result);
+    }
+
+    // frames of `--entropy` and `--crc` and blocks of `--columnar` are complete, they are not merged with each other
+    if (ENTROPY || CRC || COLUMNAR) {
+        if (!ANALYZE_ONLY) {
+            fwrite(result->buffer, sizeof(unsigned char), result->len, writer->out);
+            writer->out_len += result->len;
+        }
+    } else {
+        // a hole merges into the pending run like one (possibly very long) pair of '\0'
+        if (result->zero_run > 0 && !ANALYZE_ONLY) {
+            merge_run(writer, '\0', result->zero_run);
+        }
+
+        if (WIDTH == 8) {
+            for (size_t j = 0; j < result->len && !ANALYZE_ONLY; j += 2) {
+                merge_run(writer, result->buffer[j], result->buffer[j + 1]);
+            }
+        } else {
+            merge_elements(writer, result);
+        }
+    }
+
+    if (PERF) {
+        perf_end(PHASE_MERGE, TASK_QUEUE[slot]->end - TASK_QUEUE[slot]->start);
+    }
+}
+
+// Write and merge results in RESULT_QUEUE parallelly, waiting on the `ready` semaphore of each slot, to the output of
+// writer (`stdout` by default)
+void write_result(Writer *writer) {
+    size_t i = 0;
+
+    // a new output of `--filter` or `--width` starts with its header, an appended one has it already
+    if (has_header() && writer->out_len == 0 && !ANALYZE_ONLY) {
+        write_header(writer);
+    }
+
+    while (1) {
+        size_t slot = i % MAX_TASK_NUM;
+
+        // wait for the result to be ready, in follow mode whatever is written so far goes out first
+        if (!writer->flush_when_idle || sem_trywait(&RESULT_QUEUE[slot].ready) == -1) {
+            if (writer->flush_when_idle) {
+                fflush(writer->out);
+            }
+            down(&RESULT_QUEUE[slot].ready);
+        }
+
+        Result *result = RESULT_QUEUE[slot].result;
+
+        // handle the termination signal
+        if (result->len == UINT_MAX) {
+            free_slot(slot);
+            break;
+        }
+
+        // a flush task ends the trailing run held back for a followed file that was closed
+        if (result->len == FLUSH_TASK) {
+            if (writer->current_count > 0) {
+                write_pair(writer, writer->current_char, writer->current_count);
+                writer->current_count = 0;
+            }
+            free_slot(slot);
+            i++;
+            continue;
+        }
+
+        merge_result(writer, slot);
+        free_slot(slot);
+        i++;
+    }
+
+    // write any remaining char and count
+    if (writer->current_count > 0) {
+        write_pair(writer, writer->current_char, writer->current_count);
+    }
+    if (ANALYZE) {
+        analyze_end(writer);
+    }
+}
+
+/* Batch mode: `--batch dir` encodes each input to dir/<input>.enc. Instead of the one writer thread in order of id,
+   each file has its own writer, and the worker finishing the next task of a file writes it, with the tasks after it
+   that are ready too. Different files are written at the same time by different workers. */
+
+// Close the output of a file once all its tasks are written, and add its line to the manifest
+void batch_close(BatchFile *file) {
+    Writer *writer = &file->writer;
+    if (writer->current_count > 0) {
+        write_pair(writer, writer->current_char, writer->current_count);
+    }
+    if (ANALYZE) {
+        analyze_end(writer);
+    }
+    if (fclose(writer->out) != 0) {
+        handle_error("write output failed", -1);
+    }
+
+    up(&BATCH_SLOTS);
+
+    // the submitter may publish the manifest right after the last one is counted, nothing is touched after that
+    pthread_mutex_lock(&BATCH_MUTEX);
+    fprintf(BATCH_MANIFEST, "%zu\t%zu\t%zu\t%s\t%s\n", file->index, file->input_len, writer->out_len, file->input,
+            file->output);
+    pthread_mutex_destroy(&file->lock);
+    free(file->input);
+    free(file->output);
+    free(file);
+    BATCH_CLOSED++;
+    pthread_cond_signal(&BATCH_COND);
+    pthread_mutex_unlock(&BATCH_MUTEX);
+}
+
+// Write the results of a file that are ready, from its next task on, and close it after the last one.
+// Called with the lock of the file held, which workers take before storing a result: a result is written by the
+// worker storing it or the one writing at that time, and no worker touches a file after it is closed.
+void batch_write(BatchFile *file) {
+    while (file->next < file->end) {
+        size_t slot = file->next % MAX_TASK_NUM;
+        if (RESULT_QUEUE[slot].result == NULL || TASK_QUEUE[slot]->batch != file) {
+            break;
+        }
+        merge_result(&file->writer, slot);
+        free_slot(slot);
+        file->next++;
+    }
+    bool done = file->next == file->end;
+    pthread_mutex_unlock(&file->lock);
+
+    if (done) {
+        batch_close(file);
+    }
+}
+
+
+
+/* Chunk cache: `--cache file` keeps the pairs of each chunk in a mapped file keyed by the XXH64 hash of the chunk,
+   so re-encoding a mostly unchanged file only runs encoder() on the changed chunks. The writer merges cached pairs
+   with their neighbours like any other result. */
+
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+uint64_t xxh_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t xxh_read64(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    return xxh_rotl(acc, 31) * XXH_PRIME64_1;
+}
+
+uint64_t xxh_merge_round(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+// XXH64 content hash of a chunk
+uint64_t xxh64(const unsigned char *p, size_t len) {
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = XXH_PRIME64_1 + XXH_PRIME64_2, v2 = XXH_PRIME64_2, v3 = 0, v4 = -XXH_PRIME64_1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+        }
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge_round(h, v1);
+        h = xxh_merge_round(h, v2);
+        h = xxh_merge_round(h, v3);
+        h = xxh_merge_round(h, v4);
+    } else {
+        h = XXH_PRIME64_5;
+    }
+    h += len;
+
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        h ^= (uint64_t)v * XXH_PRIME64_1;
+        h = xxh_rotl(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= (*p) * XXH_PRIME64_5;
+        h = xxh_rotl(h, 11) * XXH_PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+// Bytes of a slot of the chunk cache, its pairs fit a chunk of CHUNK_LEN with no run
+size_t cache_slot_len() {
+    return sizeof(CacheSlot) + 2 * CHUNK_LEN;
+}
+
+// Map the chunk cache file, create it (sparse) or reset it if it was made for another chunk size.
+// A larger chunk takes fewer slots, so the file still holds CACHE_SLOTS chunks of CHUNK_SIZE.
+void open_cache(const char *path) {
+    uint32_t num_slots = CACHE_SLOTS / (CHUNK_LEN / CHUNK_SIZE);
+    size_t size = sizeof(Cache) + num_slots * cache_slot_len();
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        handle_error("open cache failed", -1);
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        handle_error("get cache size failed", fd);
+    }
+
+    Cache header;
+    bool valid = (size_t)sb.st_size == size && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                 && memcmp(header.magic, "NYUCACHE", 8) == 0
+                 && header.chunk_size == CHUNK_LEN && header.num_slots == num_slots;
+    if (!valid && (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1)) {
+        handle_error("create cache failed", fd);
+    }
+
+    CACHE = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (CACHE == MAP_FAILED) {
+        handle_error("map cache failed", fd);
+    }
+    close(fd);
+
+    if (!valid) {
+        memcpy(CACHE->magic, "NYUCACHE", 8);
+        CACHE->chunk_size = CHUNK_LEN;
+        CACHE->num_slots = num_slots;
+    }
+}
+
+// Look up the chunk of a task in the chunk cache, encode and store it on a miss.
+// A slot is written under an odd `seq` (seqlock), so a reader racing with a writer, even in another process, misses.
+Result* cached_encoder(Task *task) {
+    if (CACHE == NULL || task->addr == NULL) {
+        return encoder(task);
+    }
+
+    const unsigned char *chunk = (const unsigned char *)task->addr + task->start;
+    uint32_t src_len = task->end - task->start;
+    uint64_t hash = xxh64(chunk, src_len) ^ (uint64_t)WIDTH * XXH_PRIME64_1;     // pairs depend on `--width`
+    if (hash == 0) {
+        hash = 1;                                   // 0 marks an empty slot
+    }
+    CacheSlot *slot = (CacheSlot *)(CACHE->slots + hash % CACHE->num_slots * cache_slot_len());
+
+    __atomic_fetch_add(&CACHE_LOOKUPS, 1, __ATOMIC_RELAXED);
+
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq % 2 == 0 && slot->hash == hash && slot->src_len == src_len && slot->len <= 2 * CHUNK_LEN) {
+        Result *result = arena_calloc(sizeof(Result));
+        result->len = slot->len;
+        result->buffer = arena_alloc(result->len);
+        memcpy(result->buffer, slot->pairs, result->len);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq && slot->hash == hash) {
+            __atomic_fetch_add(&CACHE_HITS, 1, __ATOMIC_RELAXED);
+            if (ANALYZE) {
+                analyze_result(analysis_for(task->file), result);
+            }
+            return result;
+        }
+        arena_free(result->buffer);
+        arena_free(result);
+    }
+
+    Result *result = encoder(task);
+
+    // store the pairs unless another thread is writing this slot right now, or they do not fit (`--width=bit`)
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if (result->len <= 2 * CHUNK_LEN && seq % 2 == 0
+        && __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        slot->hash = hash;
+        slot->src_len = src_len;
+        slot->len = result->len;
+        memcpy(slot->pairs, result->buffer, result->len);
+        __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    }
+
+    return result;
+}
+
+// Report the hit ratio of the chunk cache to `stderr` and reset it for the next job
+void report_cache() {
+    if (CACHE == NULL) {
+        return;
+    }
+    fprintf(stderr, "nyuenc: chunk cache hit ratio %.1f%% (%zu/%zu chunks)\n",
+            CACHE_LOOKUPS ? 100.0 * CACHE_HITS / CACHE_LOOKUPS : 0.0, CACHE_HITS, CACHE_LOOKUPS);
+    CACHE_HITS = 0;
+    CACHE_LOOKUPS = 0;
+}
+
+
+
+
+/* Pre-filters: `--filter` replaces each byte by its difference (or XOR) with the byte `stride` before it, so slowly
+   changing counters and interleaved records become runs of 0. A task is filtered into its own buffer before
+   encoding, the bytes before the task are read from its mapping, or from Task.prev at the start of a submission,
+   so tasks stay independent. The output starts with a header naming the filter for `nyuenc decode`. */
+
+// out[i] = in[i] - in[i - stride], `before` holds the `stride` bytes before in
+void filter_delta(unsigned char *out, const unsigned char *in, size_t len, const unsigned char *before, size_t stride) {
+    size_t i = 0;
+    for (; i < len && i < stride; i++) {
+        out[i] = in[i] - before[i];
+    }
+    for (; i + 32 <= len; i += 32) {
+        v32u8 a, b;
+        memcpy(&a, in + i, sizeof(a));
+        memcpy(&b, in + i - stride, sizeof(b));
+        a -= b;
+        memcpy(out + i, &a, sizeof(a));
+    }
+    for (; i < len; i++) {
+        out[i] = in[i] - in[i - stride];
+    }
+}
+
+// out[i] = in[i] ^ in[i - stride], `before` holds the `stride` bytes before in
+void filter_xor(unsigned char *out, const unsigned char *in, size_t len, const unsigned char *before, size_t stride) {
+    size_t i = 0;
+    for (; i < len && i < stride; i++) {
+        out[i] = in[i] ^ before[i];
+    }
+    for (; i + 32 <= len; i += 32) {
+        v32u8 a, b;
+        memcpy(&a, in + i, sizeof(a));
+        memcpy(&b, in + i - stride, sizeof(b));
+        a ^= b;
+        memcpy(out + i, &a, sizeof(a));
+    }
+    for (; i < len; i++) {
+        out[i] = in[i] ^ in[i - stride];
+    }
+}
+
+// Undo filter_delta in place, the first `stride` bytes of data are the decoded bytes before it
+void unfilter_delta(unsigned char *data, size_t len, size_t stride) {
+    for (size_t i = stride; i < len; i++) {
+        data[i] += data[i - stride];
+    }
+}
+
+// Undo filter_xor in place, the first `stride` bytes of data are the decoded bytes before it
+void unfilter_xor(unsigned char *data, size_t len, size_t stride) {
+    for (size_t i = stride; i < len; i++) {
+        data[i] ^= data[i - stride];
+    }
+}
+
+const Filter FILTERS[NUM_FILTERS] = {
+    [FILTER_NONE] = {"none", NULL, NULL},
+    [FILTER_DELTA] = {"delta", filter_delta, unfilter_delta},
+    [FILTER_XOR] = {"xor", filter_xor, unfilter_xor},
+};
+
+// Shift the bytes [from, to) of a file into STREAM_TAIL, only the last MAX_STRIDE of them matter
+void shift_stream_tail(int fd, size_t from, size_t to) {
+    if (to - from > MAX_STRIDE) {
+        from = to - MAX_STRIDE;
+    }
+    size_t len = to - from;
+    unsigned char bytes[MAX_STRIDE];
+    if (len == 0 || pread(fd, bytes, len, from) != (ssize_t)len) {
+        return;
+    }
+
+    memmove(STREAM_TAIL, STREAM_TAIL + len, MAX_STRIDE - len);
+    memcpy(STREAM_TAIL + MAX_STRIDE - len, bytes, len);
+}
+
+// out = in ^ the base file at `offset` of the input, the input past the end of the base file is kept as is
+void xor_base(unsigned char *out, const unsigned char *in, size_t len, size_t offset) {
+    size_t i = 0;
+    size_t covered = (offset >= BASE_LEN) ? 0 : (BASE_LEN - offset < len) ? BASE_LEN - offset : len;
+    for (; i + 32 <= covered; i += 32) {
+        v32u8 a, b;
+        memcpy(&a, in + i, sizeof(a));
+        memcpy(&b, BASE + offset + i, sizeof(b));
+        a ^= b;
+        memcpy(out + i, &a, sizeof(a));
+    }
+    for (; i < covered; i++) {
+        out[i] = in[i] ^ BASE[offset + i];
+    }
+    if (out != in) {
+        memcpy(out + i, in + i, len - i);
+    }
+}
+
+// Filter a data task into a new buffer and encode that instead, holes stay holes (see submit_extents).
+// With `--base` the task (and the bytes before it for the filter) is XORed with the base file first,
+// reading the input and the base in the same pass.
+Result* filtered_encoder(Task *task) {
+    if ((FILTER == FILTER_NONE && BASE_PATH == NULL) || task->addr == NULL) {
+        return cached_encoder(task);
+    }
+
+    const unsigned char *addr = (const unsigned char *)task->addr;
+    const unsigned char *in = addr + task->start;
+    size_t len = task->end - task->start;
+    unsigned char *xored = NULL;
+    unsigned char *filtered = NULL;
+
+    // the `stride` bytes before the task, from the same addr unless they come before its submission
+    unsigned char before[MAX_STRIDE];
+    for (size_t k = 0; FILTER != FILTER_NONE && k < STRIDE; k++) {
+        if (task->start + k >= task->base + STRIDE) {
+            before[k] = addr[task->start + k - STRIDE];
+        } else {
+            before[k] = task->prev[MAX_STRIDE - (task->base + STRIDE - task->start - k)];
+        }
+        if (BASE_PATH != NULL && task->offset + k >= STRIDE) {
+            xor_base(&before[k], &before[k], 1, task->offset + k - STRIDE);
+        }
+    }
+
+    if (BASE_PATH != NULL) {
+        xored = malloc(len);
+        xor_base(xored, in, len, task->offset);
+        in = xored;
+    }
+    if (FILTER != FILTER_NONE) {
+        filtered = malloc(len);
+        FILTERS[FILTER].apply(filtered, in, len, before, STRIDE);
+        in = filtered;
+    }
+
+    Task shadow = *task;
+    shadow.addr = (const char *)in;
+    shadow.start = 0;
+    shadow.end = len;
+    Result *result = cached_encoder(&shadow);
+
+    free(xored);
+    free(filtered);
+    return result;
+}
+
+// Map the base file of `--base`, an empty one is not mapped
+void open_base(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        handle_error("open base failed", -1);
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        handle_error("get size failed", fd);
+    }
+
+    BASE_LEN = sb.st_size;
+    if (BASE_LEN > 0) {
+        BASE = mmap(NULL, BASE_LEN, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (BASE == MAP_FAILED) {
+            handle_error("map base failed", fd);
+        }
+    }
+    close(fd);
+}
+
+
+/* Entropy stage: with `--entropy` each worker codes the pairs of its task with two canonical Huffman codes, one for
+   the elements and one for the counts, built from the histogram of the task. The result becomes a frame
+   `<type, body length (4 bytes), body>` which the writer only appends, so frames can be decoded in parallel.
+   A frame is kept as plain pairs if the code does not make it smaller, a hole is a count of zero elements. */
+
+// Compare symbols by frequency for qsort, the frequencies come through a thread local pointer
+_Thread_local const uint32_t *SORT_FREQ;
+int compare_freq(const void *a, const void *b) {
+    uint32_t fa = SORT_FREQ[*(const int *)a];
+    uint32_t fb = SORT_FREQ[*(const int *)b];
+    return (fa > fb) - (fa < fb);
+}
+
+// Code lengths of a Huffman code for freq, with the two-queue method on symbols sorted by frequency.
+// Codes longer than MAX_CODE_LEN are avoided by halving the frequencies and building again.
+void huffman_lengths(const uint32_t *freq, unsigned char *lengths) {
+    uint32_t scaled[256];
+    memcpy(scaled, freq, sizeof(scaled));
+    memset(lengths, 0, 256);
+
+    while (1) {
+        int symbols[256];
+        int n = 0;
+        for (int c = 0; c < 256; c++) {
+            if (scaled[c] > 0) {
+                symbols[n++] = c;
+            }
+        }
+        if (n <= 1) {
+            if (n == 1) {
+                lengths[symbols[0]] = 1;
+            }
+            return;
+        }
+        SORT_FREQ = scaled;
+        qsort(symbols, n, sizeof(int), compare_freq);
+
+        // leaves are 0..n-1 by frequency, internal nodes n..2n-2 are created in order of weight
+        uint64_t weight[512];
+        int parent[512];
+        for (int k = 0; k < n; k++) {
+            weight[k] = scaled[symbols[k]];
+        }
+        int leaf = 0, node = n;
+        for (int next = n; next < 2 * n - 1; next++) {
+            int pick[2];
+            for (int t = 0; t < 2; t++) {
+                if (leaf < n && (node >= next || weight[leaf] <= weight[node])) {
+                    pick[t] = leaf++;
+                } else {
+                    pick[t] = node++;
+                }
+            }
+            weight[next] = weight[pick[0]] + weight[pick[1]];
+            parent[pick[0]] = next;
+            parent[pick[1]] = next;
+        }
+
+        int depth[512];
+        depth[2 * n - 2] = 0;
+        int longest = 0;
+        for (int k = 2 * n - 3; k >= 0; k--) {
+            depth[k] = depth[parent[k]] + 1;
+            if (k < n && depth[k] > longest) {
+                longest = depth[k];
+            }
+        }
+        if (longest <= MAX_CODE_LEN) {
+            for (int k = 0; k < n; k++) {
+                lengths[symbols[k]] = depth[k];
+            }
+            return;
+        }
+        for (int c = 0; c < 256; c++) {
+            scaled[c] = (scaled[c] + 1) / 2;
+        }
+    }
+}
+
+// Assign canonical codes (by length, then symbol) to the lengths of huffman, and the tables for decoding
+void canonical_codes(Huffman *huffman) {
+    memset(huffman->count, 0, sizeof(huffman->count));
+    for (int c = 0; c < 256; c++) {
+        huffman->count[huffman->lengths[c]]++;
+    }
+    huffman->count[0] = 0;
+
+    uint16_t next_code[MAX_CODE_LEN + 2];
+    int offset[MAX_CODE_LEN + 2];
+    uint16_t code = 0;
+    int sorted = 0;
+    for (int len = 1; len <= MAX_CODE_LEN; len++) {
+        code = (code + huffman->count[len - 1]) << 1;
+        next_code[len] = code;
+        offset[len] = sorted;
+        sorted += huffman->count[len];
+    }
+    for (int c = 0; c < 256; c++) {
+        int len = huffman->lengths[c];
+        if (len > 0) {
+            huffman->codes[c] = next_code[len]++;
+            huffman->sorted[offset[len]++] = c;
+        }
+    }
+}
+
+// Write the code lengths of huffman: a bitmap of the symbols used, then a 4-bit length for each of them.
+// Return the bytes written.
+size_t write_lengths(unsigned char *out, const Huffman *huffman) {
+    memset(out, 0, 32);
+    size_t len = 32;
+    int used = 0;
+    for (int c = 0; c < 256; c++) {
+        if (huffman->lengths[c] == 0) {
+            continue;
+        }
+        out[c / 8] |= 1 << (c % 8);
+        if (used % 2 == 0) {
+            out[len++] = huffman->lengths[c];
+        } else {
+            out[len - 1] |= huffman->lengths[c] << 4;
+        }
+        used++;
+    }
+    return len;
+}
+
+// Replace the pairs (or hole) of a result by its frame
+void entropy_frame(Result *result) {
+    if (result->buffer == NULL) {
+        result->buffer = arena_alloc(FRAME_HEAD_LEN + 8);
+        result->buffer[0] = FRAME_ZERO;
+        put_le(result->buffer + 1, 8, 4);
+        put_le(result->buffer + FRAME_HEAD_LEN, result->zero_run, 8);
+        result->len = FRAME_HEAD_LEN + 8;
+        result->zero_run = 0;
+        return;
+    }
+
+    const unsigned char *pairs = result->buffer;
+    size_t len = result->len;
+
+    uint32_t freq[2][256] = {{0}};
+    for (size_t j = 0; j < len; j++) {
+        freq[j % PAIR_LEN == PAIR_LEN - 1][pairs[j]]++;
+    }
+    Huffman huffman[2];
+    uint64_t bits = 0;
+    for (int t = 0; t < 2; t++) {
+        huffman_lengths(freq[t], huffman[t].lengths);
+        canonical_codes(&huffman[t]);
+        for (int c = 0; c < 256; c++) {
+            bits += (uint64_t)freq[t][c] * huffman[t].lengths[c];
+        }
+    }
+
+    // length of pairs, two tables of at most 32 + 128 bytes, then the codes (or the plain pairs if they are smaller)
+    size_t cap = FRAME_HEAD_LEN + 4 + 2 * (32 + 128) + (bits + 7) / 8 + 8;
+    unsigned char *frame = arena_alloc((cap > FRAME_HEAD_LEN + len) ? cap : FRAME_HEAD_LEN + len);
+    size_t frame_len = FRAME_HEAD_LEN;
+    put_le(frame + frame_len, len, 4);
+    frame_len += 4;
+    frame_len += write_lengths(frame + frame_len, &huffman[0]);
+    frame_len += write_lengths(frame + frame_len, &huffman[1]);
+
+    if (frame_len + (bits + 7) / 8 >= FRAME_HEAD_LEN + len) {
+        // plain pairs are smaller
+        frame[0] = FRAME_PAIRS;
+        memcpy(frame + FRAME_HEAD_LEN, pairs, len);
+        frame_len = FRAME_HEAD_LEN + len;
+    } else {
+        // codes are written from the most significant bit
+        uint64_t acc = 0;
+        int acc_bits = 0;
+        for (size_t j = 0; j < len; j++) {
+            const Huffman *code = &huffman[j % PAIR_LEN == PAIR_LEN - 1];
+            acc = (acc << code->lengths[pairs[j]]) | code->codes[pairs[j]];
+            acc_bits += code->lengths[pairs[j]];
+            while (acc_bits >= 8) {
+                acc_bits -= 8;
+                frame[frame_len++] = acc >> acc_bits;
+            }
+        }
+        if (acc_bits > 0) {
+            frame[frame_len++] = acc << (8 - acc_bits);
+        }
+        frame[0] = FRAME_HUFFMAN;
+    }
+    put_le(frame + 1, frame_len - FRAME_HEAD_LEN, 4);
+
+    arena_free(result->buffer);
+    result->buffer = frame;
+    result->len = frame_len;
+}
+
+/* Integrity frames: with `--crc` each task is written as a frame `<input length, body length, CRC32C of the input,
+   CRC32C of the body, body>` (little endian, 8, 4, 4 and 4 bytes), the body being the pairs of the task, not merged
+   with the next one. `nyuenc check` validates the bodies without decoding, `nyuenc decode` also checks that each
+   frame decodes to its input. A hole is a frame with no body, the CRC of its zeros is computed without reading them.
+   The worker uses the SSE4.2 crc32 instruction where the CPU has it, a table otherwise. */
+
+uint32_t CRC32C_TABLE[256];             // CRC32C of each byte, for CPUs without SSE4.2
+uint32_t CRC32C_X2N[32];                // x^(2^n) modulo the polynomial, for runs of zeros
+bool CRC32C_HW = false;
+pthread_once_t CRC32C_ONCE = PTHREAD_ONCE_INIT;
+
+// Multiply a and b modulo the polynomial (reflected, x^0 is the high bit)
+uint32_t crc32c_multiply(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    for (uint32_t m = 1u << 31; m != 0; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+        }
+        b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+// Fill the tables and find out if the CPU has SSE4.2, once
+void crc32c_init() {
+    for (uint32_t c = 0; c < 256; c++) {
+        uint32_t crc = c;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        CRC32C_TABLE[c] = crc;
+    }
+    CRC32C_X2N[0] = 1u << 30;                   // x^1
+    for (int n = 1; n < 32; n++) {
+        CRC32C_X2N[n] = crc32c_multiply(CRC32C_X2N[n - 1], CRC32C_X2N[n - 1]);
+    }
+#if defined(__x86_64__)
+    CRC32C_HW = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+#if defined(__x86_64__)
+// CRC32C (not inverted) of len bytes with the crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    for (; len > 0; p++, len--) {
+        c = _mm_crc32_u8((uint32_t)c, *p);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+// CRC32C of len bytes at p, continuing crc (0 to start)
+uint32_t crc32c(uint32_t crc, const unsigned char *p, size_t len) {
+    pthread_once(&CRC32C_ONCE, crc32c_init);
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (CRC32C_HW) {
+        return ~crc32c_hw(crc, p, len);
+    }
+#endif
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc >> 8) ^ CRC32C_TABLE[(crc ^ p[i]) & 0xFF];
+    }
+    return ~crc;
+}
+
+// CRC32C of len zero bytes continuing crc: a zero byte multiplies the register by x^8, so len of them by x^(8 len)
+uint32_t crc32c_zeros(uint32_t crc, uint64_t len) {
+    pthread_once(&CRC32C_ONCE, crc32c_init);
+    uint32_t power = 1u << 31;                  // x^0
+    for (int n = 3; len > 0; len >>= 1, n++) {
+        if (len & 1) {
+            power = crc32c_multiply(CRC32C_X2N[n % 32], power);
+        }
+    }
+    return ~crc32c_multiply(power, ~crc);
+}
+
+// Replace the pairs (or hole) of a result by its frame
+void crc_frame(Task *task, Result *result) {
+    size_t input_len = task->end - task->start;
+    uint32_t input_crc = (task->addr == NULL) ? crc32c_zeros(0, input_len)
+                                              : crc32c(0, (const unsigned char *)task->addr + task->start, input_len);
+
+    unsigned char *frame = arena_alloc(CRC_HEAD_LEN + result->len);
+    put_le(frame, input_len, 8);
+    put_le(frame + 8, result->len, 4);
+    put_le(frame + 12, input_crc, 4);
+    put_le(frame + 16, crc32c(0, result->buffer, result->len), 4);
+    if (result->len > 0) {
+        memcpy(frame + CRC_HEAD_LEN, result->buffer, result->len);
+    }
+
+    arena_free(result->buffer);
+    result->buffer = frame;
+    result->len += CRC_HEAD_LEN;
+    result->zero_run = 0;
+}
+
+/* Unordered output: with `--unordered` a worker writes its chunk right after encoding it, as a record
+   `<sequence id, input offset, input length, length of pairs, pairs>` (little endian, 8, 8, 8 and 4 bytes), so one slow
+   chunk does not hold back the chunks after it. Pairs are not merged across chunks, a record with no pairs is a hole.
+   The writer still takes the (empty) results in order, only to give the slots back. */
+
+// Write the record of a task, then empty the result so the writer has nothing to merge
+void write_record(Task *task, Result *result) {
+    unsigned char head[RECORD_HEAD_LEN];
+    put_le(head, task->id, 8);
+    put_le(head + 8, task->offset, 8);
+    put_le(head + 16, task->end - task->start, 8);
+    put_le(head + 24, result->len, 4);
+
+    pthread_mutex_lock(&RECORD_MUTEX);
+    fwrite(head, sizeof(unsigned char), RECORD_HEAD_LEN, stdout);
+    fwrite(result->buffer, sizeof(unsigned char), result->len, stdout);
+    if (fflush(stdout) != 0) {
+        handle_error("write output failed", -1);
+    }
+    pthread_mutex_unlock(&RECORD_MUTEX);
+
+    arena_free(result->buffer);
+    result->buffer = NULL;
+    result->len = 0;
+    result->zero_run = 0;
+}
+
+// Writer thread process, the main thread keeps submitting tasks while results are written
+void *writer_process(void *args) {
+    if (PERF) {
+        perf_attach(&PERF_THREADS[NUM_PERF_THREADS - 1]);
+    }
+    if (LATENCY) {
+        LATENCY_SELF = &LATENCY_THREADS[NUM_LATENCY_THREADS - 1];
+    }
+
+    write_result(args);
+
+    if (PERF) {
+        perf_detach();
+    }
+    return NULL;
+}
+
+/* The idea of creating threads pool is from: [Thread Pools in C (using the PTHREAD API)](https://www.youtube.com/watch?v=_n2hE2gyPxU) */
+
+// Submit tasks to TASK_QUEUE, update the POOL.submitted and signal wake up threads to take task from TASK_QUEUE.
+// Wait for a free slot first if MAX_TASK_NUM tasks are not written yet.
+void task_submission(Task* task) {
+    down(&POOL.free_slots);
+
+    if (LATENCY) {
+        task->submit_ns = now_ns();
+    }
+
+    pthread_mutex_lock(&POOL.mutex);
+    TASK_QUEUE[POOL.submitted % MAX_TASK_NUM] = task;
+    POOL.submitted++;
+    pthread_cond_signal(&POOL.cond);
+    pthread_mutex_unlock(&POOL.mutex);
+}
+
+// Worker threads process, args is the index of the thread
+void *thread_process(void *args) {
+    if (PERF) {
+        perf_attach(&PERF_THREADS[(intptr_t)args]);
+    }
+    if (LATENCY) {
+        LATENCY_SELF = &LATENCY_THREADS[(intptr_t)args];
+    }
+    WORKER_INDEX = (intptr_t)args;
+
+    while (1) {
+        if (PERF) {
+            perf_begin();
+        }
+
+        // lock the TASK_QUEUE
+        pthread_mutex_lock(&POOL.mutex);
+
+        // wait for task when there is no unprocessed task in TASK_QUEUE and all the tasks are not processed yet
+        while (POOL.submitted <= POOL.processed && !POOL.all_processed) {
+            pthread_cond_wait(&POOL.cond, &POOL.mutex);
+        }
+
+        // the threads pool is shut down
+        if (POOL.submitted <= POOL.processed) {
+            pthread_mutex_unlock(&POOL.mutex);
+            break;
+        }
+
+        Task task = *TASK_QUEUE[POOL.processed % MAX_TASK_NUM];
+
+        // update the POOL.processed and unlock the TASK_QUEUE
+        POOL.processed++;
+        pthread_mutex_unlock(&POOL.mutex);
+
+        if (PERF) {
+            perf_end(PHASE_WAIT, task.end - task.start);
+        }
+
+        uint64_t start_ns = 0;
+        if (LATENCY) {
+            start_ns = now_ns();
+            hist_record(&LATENCY_SELF->wait, start_ns - task.submit_ns);
+        }
+
+        // detect if the task is a poison task, it ends the output of current job but not the thread,
+        // so the same threads pool keeps serving the next job of `--serve`. A flush task is passed on the same way.
+        if ((task.start == UINT_MAX && task.end == UINT_MAX) || (task.start == FLUSH_TASK && task.end == FLUSH_TASK)) {
+            // create poison (or flush) results
+            Result *result = arena_calloc(sizeof(Result));
+            result->len = task.start;
+            RESULT_QUEUE[task.id % MAX_TASK_NUM].result = result;
+            up(&RESULT_QUEUE[task.id % MAX_TASK_NUM].ready);  // inform this task is ready to write
+            continue;
+        }
+
+        if (PERF) {
+            perf_begin();
+        }
+
+        Result* result = filtered_encoder(&task);
+        if (ENTROPY) {
+            entropy_frame(result);
+        }
+        if (CRC) {
+            crc_frame(&task, result);
+        }
+        if (UNORDERED) {
+            write_record(&task, result);
+        }
+
+        if (PERF) {
+            perf_end(PHASE_ENCODE, task.end - task.start);
+        }
+        if (LATENCY) {
+            result->ready_ns = now_ns();
+            hist_record(&LATENCY_SELF->encode, result->ready_ns - start_ns);
+        }
+
+        // with `--batch` the worker writes the output of the file itself, if the task is the next one of the file
+        if (task.batch != NULL) {
+            pthread_mutex_lock(&task.batch->lock);
+            RESULT_QUEUE[task.id % MAX_TASK_NUM].result = result;
+            batch_write(task.batch);
+            continue;
+        }
+
+        RESULT_QUEUE[task.id % MAX_TASK_NUM].result = result;
+        up(&RESULT_QUEUE[task.id % MAX_TASK_NUM].ready);  // inform this task is ready to write
+    }
+
+    if (PERF) {
+        perf_detach();
+    }
+    return NULL;
+}
+
+// Create a task with the next id
+Task* new_task(const char *addr, size_t start, size_t end, size_t *id) {
+    Task *task = arena_calloc(sizeof(Task));
+    task->addr = addr;
+    task->start = start;
+    task->end = end;
+    task->id = *id;
+    task->file = SUBMIT_FILE;
+    task->batch = SUBMIT_BATCH;
+    (*id)++;
+    return task;
+}
+
+// Segment a data extent [start, end) of a mapped file by CHUNK_LEN and submit each piece as a task
+void submit_data(Mapping *map, size_t start, size_t end, size_t *id) {
+    for (size_t size = start; size < end; size += CHUNK_LEN) {
+        Task *task = new_task(map->addr, size, (size + CHUNK_LEN > end) ? end : size + CHUNK_LEN, id);
+        task->map = map;
+        task->offset = map->offset + (size - map->base);
+        if (FILTER != FILTER_NONE) {
+            task->base = map->base;
+            memcpy(task->prev, map->prev, MAX_STRIDE);
+        }
+        __atomic_add_fetch(&map->refs, 1, __ATOMIC_RELAXED);
+
+        task_submission(task);
+    }
+}
+
+// Submit a hole [start, end) of a mapped file as one task with NULL addr, its pages are never touched
+void submit_hole(Mapping *map, size_t start, size_t end, size_t *id) {
+    Task *task = new_task(NULL, start, end, id);
+    task->offset = map->offset + (start - map->base);
+    task_submission(task);
+}
+
+// Walk data and hole extents of a file with SEEK_DATA/SEEK_HOLE, only data extents are chunked into tasks.
+// If the file system does not report holes, the whole file is treated as one data extent.
+// With `--filter` the first `stride` bytes of a hole depend on the data before it, so they are submitted as data.
+void submit_extents(int fd, Mapping *map, size_t offset, size_t size, size_t *id) {
+    while (offset < size) {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data == -1) {
+            // ENXIO: no more data after offset, the rest of file is a hole
+            data = (errno == ENXIO) ? (off_t)size : (off_t)offset;
+        }
+        if ((size_t)data > size) {
+            data = size;
+        }
+        // a hole XORed with the base file of `--base` is the base file, only the part past its end stays a hole
+        size_t input_offset = map->offset + (offset - map->base);
+        if ((size_t)data > offset && BASE_PATH != NULL && input_offset < BASE_LEN) {
+            size_t covered = (BASE_LEN - input_offset < (size_t)data - offset) ? BASE_LEN - input_offset
+                                                                                 : (size_t)data - offset;
+            submit_data(map, offset, offset + covered, id);
+            offset += covered;
+        }
+        if ((size_t)data > offset && FILTER != FILTER_NONE) {
+            size_t head = (WIDTH > 8) ? (STRIDE + WIDTH / 8 - 1) / (WIDTH / 8) * (WIDTH / 8) : STRIDE;
+            head = ((size_t)data - offset < head) ? (size_t)data - offset : head;
+            submit_data(map, offset, offset + head, id);
+            offset += head;
+        }
+        // a hole of `--width` is whole elements, the bytes left over are encoded as data
+        size_t hole_end = (WIDTH > 8) ? offset + ((size_t)data - offset) / (WIDTH / 8) * (WIDTH / 8) : (size_t)data;
+        if (hole_end > offset) {
+            submit_hole(map, offset, hole_end, id);
+        }
+        if ((size_t)data > hole_end) {
+            submit_data(map, hole_end, data, id);
+        }
+        if ((size_t)data == size) {
+            break;
+        }
+
+        off_t hole = lseek(fd, data, SEEK_HOLE);
+        if (hole == -1 || (size_t)hole > size) {
+            hole = size;
+        }
+        submit_data(map, data, hole, id);
+        offset = hole;
+    }
+}
+
+// Submit the collected small files as one composite task, they are encoded as one stream
+// so runs crossing file boundaries are merged by the encoder itself
+void flush_pack(Pack *pack, size_t *id) {
+    if (pack->len == 0) {
+        return;
+    }
+
+    Task *task = new_task(pack->buffer, 0, pack->len, id);
+    task->pack = pack->buffer;
+    task->offset = pack->offset;
+    memcpy(task->prev, pack->prev, MAX_STRIDE);
+
+    task_submission(task);
+
+    pack->buffer = NULL;
+    pack->len = 0;
+}
+
+// Read a small file (less than CHUNK_SIZE) from offset into the pack with plain pread(), submit the pack first if it is full
+void read_into_pack(Pack *pack, int fd, size_t offset, size_t size, size_t *id) {
+    if (pack->len + size > CHUNK_SIZE) {
+        flush_pack(pack, id);
+    }
+    if (pack->buffer == NULL) {
+        pack->buffer = malloc(CHUNK_SIZE);
+        memcpy(pack->prev, STREAM_TAIL, MAX_STRIDE);
+        pack->offset = SUBMIT_OFFSET;
+    }
+
+    while (size > 0) {
+        ssize_t n = pread(fd, pack->buffer + pack->len, size, offset);
+        if (n == -1) {
+            handle_error("read file failed", fd);
+        }
+        if (n == 0) {
+            break;      // file shrunk after fstat
+        }
+        pack->len += n;
+        offset += n;
+        size -= n;
+    }
+}
+
+// Map a file and submit its tasks after skipping its first `skip` bytes, small files go into the pack.
+// The fd is not closed here. Return the size of the file.
+// With `--filter` the submitted bytes are the input right before the next submission.
+size_t submit_file(int fd, size_t skip, Pack *pack, size_t *id) {
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        handle_error("get size failed", fd);
+    }
+
+    // an empty (or already encoded) file has nothing to map or encode
+    if ((size_t)sb.st_size <= skip) {
+        return sb.st_size;
+    }
+
+    // small files are coalesced into composite tasks instead of one mapping and task each,
+    // but not across files with `--analyze` which counts each file on its own
+    if (sb.st_size - skip < CHUNK_SIZE) {
+        read_into_pack(pack, fd, skip, sb.st_size - skip, id);
+        if (ANALYZE) {
+            flush_pack(pack, id);
+        }
+        if (FILTER != FILTER_NONE) {
+            shift_stream_tail(fd, skip, sb.st_size);
+        }
+        SUBMIT_OFFSET += sb.st_size - skip;
+        return sb.st_size;
+    }
+
+    // keep the order of input: small files collected so far go before this file
+    flush_pack(pack, id);
+
+    char *addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) { 
+        handle_error("map file failed", fd);
+    }
+    if (THP_INPUT) {
+        madvise(addr, sb.st_size, MADV_HUGEPAGE);      // a hint, page cache THP needs kernel support
+    }
+    Mapping *map = malloc(sizeof(Mapping));
+    map->addr = addr;
+    map->len = sb.st_size;
+    map->refs = 1;                      // held by the submission until all tasks are submitted
+    map->base = skip;
+    memcpy(map->prev, STREAM_TAIL, MAX_STRIDE);
+    map->offset = SUBMIT_OFFSET;
+
+    // for each file we segment data extents by CHUNK_SIZE(4KB) and assign it to tasks, holes become zero runs
+    submit_extents(fd, map, skip, sb.st_size, id);
+    release_mapping(map);
+    if (FILTER != FILTER_NONE) {
+        shift_stream_tail(fd, skip, sb.st_size);
+    }
+    SUBMIT_OFFSET += sb.st_size - skip;
+    return sb.st_size;
+}
+
+// Submit the last pack and a poison task at the end of task queue to inform there is no task
+// and will not be more tasks in TASK_QUEUE for current job
+void submit_poison(Pack *pack, size_t *id) {
+    flush_pack(pack, id);
+
+    task_submission(new_task(NULL, UINT_MAX, UINT_MAX, id));
+}
+
+// Submit a flush task, the writer writes its pending run when it gets there
+void submit_flush(Pack *pack, size_t *id) {
+    flush_pack(pack, id);
+    task_submission(new_task(NULL, FLUSH_TASK, FLUSH_TASK, id));
+}
+
+/* Inputs at scale: `-r dir` walks a tree and `-@ list` reads paths from a file (`-` for stdin), after the files of argv.
+   An input thread finds the paths while the submitter takes them from INPUT_RING, so encoding starts with the first
+   file found, and the ring is bounded so memory does not grow with the number of files. Trees are walked with
+   getdents64() by several walker threads sharing a stack of directories (only one keeps the order of a stream on
+   `stdout`, `--batch` outputs can come in any order). Symbolic links are not followed. */
+
+char *INPUT_RING[INPUT_RING_SIZE];      // Paths found and not taken by the submitter yet
+size_t INPUT_HEAD = 0;                  // Paths taken
+size_t INPUT_TAIL = 0;                  // Paths found
+bool INPUT_DONE = false;                // No more paths will be found
+pthread_mutex_t INPUT_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t INPUT_COND = PTHREAD_COND_INITIALIZER;
+pthread_t INPUT_THREAD;
+int INPUT_ARG = 0;                      // Next file of argv
+char **INPUT_ARGV = NULL;               // Files of argv, found first by the input thread
+int INPUT_ARGC = 0;
+int NUM_WALKERS = 1;                    // Walker threads of `-r`
+WalkDir *WALK_DIRS = NULL;              // Directories not walked yet
+int WALK_ACTIVE = 0;                    // Walkers reading a directory, which may find more
+pthread_mutex_t WALK_MUTEX = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t WALK_COND = PTHREAD_COND_INITIALIZER;
+
+// Entry returned by getdents64(), glibc does not declare it for the raw system call
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Give a path (heap allocated) to the submitter, waiting while INPUT_RING is full
+void push_input(char *path) {
+    pthread_mutex_lock(&INPUT_MUTEX);
+    while (INPUT_TAIL - INPUT_HEAD == INPUT_RING_SIZE) {
+        pthread_cond_wait(&INPUT_COND, &INPUT_MUTEX);
+    }
+    INPUT_RING[INPUT_TAIL++ % INPUT_RING_SIZE] = path;
+    pthread_cond_broadcast(&INPUT_COND);
+    pthread_mutex_unlock(&INPUT_MUTEX);
+}
+
+// Take the next input path (heap allocated, freed by the caller), or NULL after the last one
+char *next_input(int argc, char **argv) {
+    if (NUM_INPUT_SOURCES == 0) {
+        return (optind + INPUT_ARG < argc) ? strdup(argv[optind + INPUT_ARG++]) : NULL;
+    }
+
+    pthread_mutex_lock(&INPUT_MUTEX);
+    while (INPUT_HEAD == INPUT_TAIL && !INPUT_DONE) {
+        pthread_cond_wait(&INPUT_COND, &INPUT_MUTEX);
+    }
+    char *path = (INPUT_HEAD < INPUT_TAIL) ? INPUT_RING[INPUT_HEAD++ % INPUT_RING_SIZE] : NULL;
+    pthread_cond_broadcast(&INPUT_COND);
+    pthread_mutex_unlock(&INPUT_MUTEX);
+    return path;
+}
+
+// Push a directory onto the stack of `-r`
+void push_dir(char *path) {
+    WalkDir *dir = malloc(sizeof(WalkDir));
+    dir->path = path;
+    pthread_mutex_lock(&WALK_MUTEX);
+    dir->next = WALK_DIRS;
+    WALK_DIRS = dir;
+    pthread_cond_signal(&WALK_COND);
+    pthread_mutex_unlock(&WALK_MUTEX);
+}
+
+// Read a directory with getdents64(), regular files go to the submitter and directories onto the stack
+void walk_dir(const char *path) {
+    int fd = open(path, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        fprintf(stderr, "nyuenc: %s: ", path);
+        handle_error("open directory failed", -1);
+    }
+
+    static _Thread_local char buffer[DIRENT_BUFFER];
+    long n;
+    while ((n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer))) > 0) {
+        for (long pos = 0; pos < n;) {
+            struct linux_dirent64 *entry = (struct linux_dirent64 *)(buffer + pos);
+            pos += entry->d_reclen;
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+
+            unsigned char type = entry->d_type;
+            if (type == DT_UNKNOWN) {
+                struct stat sb;
+                if (fstatat(fd, entry->d_name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+                    continue;       // removed while walking
+                }
+                type = S_ISDIR(sb.st_mode) ? DT_DIR : S_ISREG(sb.st_mode) ? DT_REG : DT_UNKNOWN;
+            }
+            if (type != DT_DIR && type != DT_REG) {
+                continue;
+            }
+
+            size_t len = strlen(path) + strlen(entry->d_name) + 2;
+            char *child = malloc(len);
+            snprintf(child, len, "%s%s%s", path, (path[strlen(path) - 1] == '/') ? "" : "/", entry->d_name);
+            if (type == DT_DIR) {
+                push_dir(child);
+            } else {
+                push_input(child);
+            }
+        }
+    }
+    if (n == -1) {
+        handle_error("read directory failed", fd);
+    }
+    close(fd);
+}
+
+// Walker thread of `-r`: walk directories from the stack until it is empty and no walker can find more
+void *walk_process(void *args) {
+    (void)args;
+    pthread_mutex_lock(&WALK_MUTEX);
+    while (1) {
+        while (WALK_DIRS == NULL && WALK_ACTIVE > 0) {
+            pthread_cond_wait(&WALK_COND, &WALK_MUTEX);
+        }
+        WalkDir *dir = WALK_DIRS;
+        if (dir == NULL) {
+            break;
+        }
+        WALK_DIRS = dir->next;
+        WALK_ACTIVE++;
+        pthread_mutex_unlock(&WALK_MUTEX);
+
+        walk_dir(dir->path);
+        free(dir->path);
+        free(dir);
+
+        pthread_mutex_lock(&WALK_MUTEX);
+        WALK_ACTIVE--;
+        if (WALK_ACTIVE == 0 && WALK_DIRS == NULL) {
+            pthread_cond_broadcast(&WALK_COND);
+        }
+    }
+    pthread_mutex_unlock(&WALK_MUTEX);
+    return NULL;
+}
+
+// Read the paths of a list of `-@`, one on each line or ended by '\0'
+void read_list(const char *path) {
+    FILE *list = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+    if (list == NULL) {
+        handle_error("open list failed", -1);
+    }
+
+    char *line = NULL;
+    size_t cap = 0;
+    size_t len = 0;
+    for (int c = getc(list);; c = getc(list)) {
+        if (c != EOF && c != '\n' && c != '\0') {
+            if (len + 1 >= cap) {
+                cap = cap * 2 + 256;
+                line = realloc(line, cap);
+            }
+            line[len++] = c;
+            continue;
+        }
+        if (len > 0) {
+            line[len] = '\0';
+            push_input(strdup(line));
+            len = 0;
+        }
+        if (c == EOF) {
+            break;
+        }
+    }
+    free(line);
+    if (list != stdin) {
+        fclose(list);
+    }
+}
+
+// Input thread: the files of argv, then `-r` and `-@` in the order given
+void *input_process(void *args) {
+    (void)args;
+    for (; optind + INPUT_ARG < INPUT_ARGC; INPUT_ARG++) {
+        push_input(strdup(INPUT_ARGV[optind + INPUT_ARG]));
+    }
+
+    for (int s = 0; s < NUM_INPUT_SOURCES; s++) {
+        if (INPUT_SOURCES[s].type == '@') {
+            read_list(INPUT_SOURCES[s].arg);
+            continue;
+        }
+
+        push_dir(strdup(INPUT_SOURCES[s].arg));
+        pthread_t walkers[NUM_WALKERS];
+        for (int w = 0; w < NUM_WALKERS; w++) {
+            if (pthread_create(&walkers[w], NULL, walk_process, NULL) != 0) {
+                handle_error("Failed to create thread", -1);
+            }
+        }
+        for (int w = 0; w < NUM_WALKERS; w++) {
+            pthread_join(walkers[w], NULL);
+        }
+    }
+
+    pthread_mutex_lock(&INPUT_MUTEX);
+    INPUT_DONE = true;
+    pthread_cond_broadcast(&INPUT_COND);
+    pthread_mutex_unlock(&INPUT_MUTEX);
+    return NULL;
+}
+
+// Start finding the inputs of `-r` and `-@` after the files of argv, walking trees with `num_walkers` threads
+void start_inputs(int argc, char **argv, int num_walkers) {
+    if (NUM_INPUT_SOURCES == 0) {
+        return;
+    }
+    INPUT_ARGC = argc;
+    INPUT_ARGV = argv;
+    NUM_WALKERS = num_walkers;
+    if (pthread_create(&INPUT_THREAD, NULL, input_process, NULL) != 0) {
+        handle_error("Failed to create thread", -1);
+    }
+}
+
+// Wait for the input thread after the last input is taken
+void finish_inputs() {
+    if (NUM_INPUT_SOURCES > 0) {
+        pthread_join(INPUT_THREAD, NULL);
+    }
+}
+
+// Read files and submit tasks, the first `skip` bytes of the input (all files in order) are already encoded.
+// Return the total size of the input.
+size_t create_tasks_from_file(int argc, char **argv, size_t skip) {
+    size_t id = 0;
+    size_t input_len = 0;
+    Pack pack = {0};
+    SUBMIT_OFFSET = skip;
+
+    start_inputs(argc, argv, 1);
+    char *path;
+    for (size_t f = 0; (path = next_input(argc, argv)) != NULL; f++) {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            handle_error("open fd failed", -1);
+        }
+        free(path);
+
+        SUBMIT_FILE = f;
+        size_t file_skip = (skip > input_len) ? skip - input_len : 0;
+        if (FILTER != FILTER_NONE && file_skip > 0) {
+            shift_stream_tail(fd, 0, file_skip);        // the part encoded by the previous run
+        }
+        size_t size = submit_file(fd, file_skip, &pack, &id);
+        input_len += size;
+        close(fd);
+    }
+    finish_inputs();
+
+    submit_poison(&pack, &id);
+    return input_len;
+}
+
+// Path of the output of an input in BATCH_DIR, the input path without leading `/`, `./` and `../` and with `.enc`.
+// The directories of it are created.
+char *batch_output_path(const char *input) {
+    while (input[0] == '/' || strncmp(input, "./", 2) == 0 || strncmp(input, "../", 3) == 0) {
+        input += (input[0] == '/') ? 1 : (input[1] == '/') ? 2 : 3;
+    }
+
+    size_t len = strlen(BATCH_DIR) + strlen(input) + 6;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/%s.enc", BATCH_DIR, input);
+
+    for (char *slash = strchr(path + strlen(BATCH_DIR) + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(path, 0777) == -1 && errno != EEXIST) {
+            handle_error("create output directory failed", -1);
+        }
+        *slash = '/';
+    }
+    return path;
+}
+
+// Open the output of an input whose first task gets the id `first`, waiting while MAX_BATCH_OPEN are open
+BatchFile *batch_open(const char *input, size_t index, size_t first) {
+    down(&BATCH_SLOTS);
+
+    BatchFile *file = calloc(1, sizeof(BatchFile));
+    pthread_mutex_init(&file->lock, NULL);
+    file->next = first;
+    file->end = SIZE_MAX;
+    file->index = index;
+    file->input = strdup(input);
+    file->output = batch_output_path(input);
+    file->writer.out = fopen(file->output, "w");
+    if (file->writer.out == NULL) {
+        handle_error("open output failed", -1);
+    }
+    if (has_header()) {
+        write_header(&file->writer);
+    }
+    return file;
+}
+
+// Submit each file as its own stream to its own output of `--batch`, then wait for all of them to be closed and
+// publish the manifest. Trees of `-r` are walked by `num_walkers` threads. Return the total size of the input.
+size_t batch_files(int argc, char **argv, int num_walkers) {
+    size_t id = 0;
+    size_t input_len = 0;
+    Pack pack = {0};
+
+    size_t len = strlen(BATCH_DIR) + sizeof("/MANIFEST.tmp");
+    char manifest[len];
+    snprintf(manifest, len, "%s/MANIFEST.tmp", BATCH_DIR);
+    BATCH_MANIFEST = fopen(manifest, "w");
+    if (BATCH_MANIFEST == NULL) {
+        handle_error("open manifest failed", -1);
+    }
+    sem_init(&BATCH_SLOTS, 0, MAX_BATCH_OPEN);
+
+    start_inputs(argc, argv, num_walkers);
+    char *path;
+    size_t num_files = 0;
+    for (; (path = next_input(argc, argv)) != NULL; num_files++) {
+        int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            handle_error("open fd failed", -1);
+        }
+
+        // every output is a stream of its own: no pack across files, no filter history or base offset carried over
+        BatchFile *file = batch_open(path, num_files, id);
+        free(path);
+        SUBMIT_FILE = num_files;
+        SUBMIT_BATCH = file;
+        SUBMIT_OFFSET = 0;
+        memset(STREAM_TAIL, 0, MAX_STRIDE);
+
+        size_t size = submit_file(fd, 0, &pack, &id);
+        flush_pack(&pack, &id);
+        file->input_len = size;
+        input_len += size;
+        close(fd);
+
+        pthread_mutex_lock(&file->lock);
+        file->end = id;
+        batch_write(file);
+    }
+    SUBMIT_BATCH = NULL;
+    finish_inputs();
+
+    pthread_mutex_lock(&BATCH_MUTEX);
+    while (BATCH_CLOSED < num_files) {
+        pthread_cond_wait(&BATCH_COND, &BATCH_MUTEX);
+    }
+    pthread_mutex_unlock(&BATCH_MUTEX);
+
+    char published[len];
+    snprintf(published, len, "%s/MANIFEST", BATCH_DIR);
+    if (fclose(BATCH_MANIFEST) != 0 || rename(manifest, published) == -1) {
+        handle_error("write manifest failed", -1);
+    }
+    sem_destroy(&BATCH_SLOTS);
+    return input_len;
+}
+
+/* Shards: `--shard i/N` encodes the i-th of N ranges of the input (all files in order, cut at multiples of CHUNK_SIZE),
+   so one encoding can be spread over processes or hosts. The pairs of a range are what a single run writes for
+   it, except for the runs crossing its ends, so a ShardFooter after them gives the first and last run and
+   `nyuenc stitch` only merges those at each boundary and copies the rest. */
+
+// Submit the tasks of the range of shard SHARD_INDEX, return its length and set its offset in the input
+size_t shard_files(int argc, char **argv, size_t *shard_offset) {
+    size_t input_len = 0;
+    for (int arg = optind; arg < argc; arg++) {
+        struct stat sb;
+        if (stat(argv[arg], &sb) == -1) {
+            handle_error("get size failed", -1);
+        }
+        input_len += sb.st_size;
+    }
+    size_t chunks = (input_len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    size_t lo = (size_t)(chunks * SHARD_INDEX / SHARD_COUNT) * CHUNK_SIZE;
+    size_t hi = (size_t)(chunks * (SHARD_INDEX + 1) / SHARD_COUNT) * CHUNK_SIZE;
+    hi = (hi < input_len) ? hi : input_len;
+    lo = (lo < hi) ? lo : hi;
+    *shard_offset = lo;
+
+    size_t id = 0;
+    size_t offset = 0;
+    for (int arg = optind; arg < argc && offset < hi; arg++) {
+        int fd = open(argv[arg], O_RDONLY);
+        struct stat sb;
+        if (fd == -1 || fstat(fd, &sb) == -1) {
+            handle_error("open fd failed", fd);
+        }
+
+        // the part of the file in [lo, hi)
+        size_t start = (lo > offset) ? lo - offset : 0;
+        size_t end = (hi - offset < (size_t)sb.st_size) ? hi - offset : (size_t)sb.st_size;
+        if (start < end) {
+            Mapping *map = calloc(1, sizeof(Mapping));
+            map->addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map->addr == MAP_FAILED) {
+                handle_error("map file failed", fd);
+            }
+            map->len = sb.st_size;
+            map->refs = 1;
+            submit_extents(fd, map, start, end, &id);
+            release_mapping(map);
+        }
+        offset += sb.st_size;
+        close(fd);
+    }
+
+    Pack pack = {0};
+    submit_poison(&pack, &id);
+    return hi - lo;
+}
+
+// Write the footer of a shard after its pairs
+void write_shard_footer(Writer *writer, size_t shard_offset, size_t shard_len) {
+    ShardFooter footer = {0};
+    memcpy(footer.magic, "NYUSHARD", 8);
+    footer.index = SHARD_INDEX;
+    footer.count = SHARD_COUNT;
+    footer.input_offset = shard_offset;
+    footer.input_len = shard_len;
+
+    // the last run is still pending in writer, the first one too if nothing else came
+    if (writer->head_count == 0) {
+        footer.head_count = writer->run_len;
+        footer.head_char = writer->current_char;
+    } else {
+        footer.head_count = writer->head_count;
+        footer.head_char = writer->head_char;
+        footer.tail_count = writer->run_len;
+        footer.tail_char = writer->current_char;
+    }
+    if (fwrite(&footer, sizeof(footer), 1, writer->out) != 1) {
+        handle_error("write output failed", -1);
+    }
+}
+
+// Current time in milliseconds for batching appended data in follow mode
+long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Read pending inotify events, mark closed files and stop watching deleted or moved ones.
+// Return the number of files still watched.
+int read_follow_events(int inotify_fd, Follow *files, int nfiles, int watching) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            for (int i = 0; i < nfiles; i++) {
+                if (files[i].wd != event->wd) {
+                    continue;
+                }
+                if (event->mask & IN_CLOSE_WRITE) {
+                    files[i].closed = true;
+                }
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                    inotify_rm_watch(inotify_fd, files[i].wd);
+                    files[i].wd = -1;
+                    files[i].closed = true;
+                    watching--;
+                }
+            }
+        }
+    }
+    return watching;
+}
+
+// Bytes appended to the followed files since last batch
+size_t follow_landed(Follow *files, int nfiles) {
+    size_t landed = 0;
+    for (int i = 0; i < nfiles; i++) {
+        struct stat sb;
+        if (fstat(files[i].fd, &sb) == 0 && (size_t)sb.st_size > files[i].offset) {
+            landed += sb.st_size - files[i].offset;
+        }
+    }
+    return landed;
+}
+
+// Follow mode (`-f`): submit the inputs, then keep submitting data appended to them like `tail -f` until every
+// file is deleted or moved, or SIGINT/SIGTERM (blocked by main) arrives. Appended data is batched for at most half
+// of FOLLOW_LATENCY_MS, and the writer flushes whenever it catches up, so only the trailing run is held back
+// until more data arrives or the file is closed. Return the total size of the input.
+size_t follow_files(int argc, char **argv, size_t skip) {
+    int nfiles = argc - optind;
+    Follow *files = calloc(nfiles, sizeof(Follow));
+    size_t id = 0;
+    size_t input_len = 0;
+    Pack pack = {0};
+    SUBMIT_OFFSET = skip;
+
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        handle_error("inotify failed", -1);
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    int signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (signal_fd == -1) {
+        handle_error("signalfd failed", inotify_fd);
+    }
+
+    for (int i = 0; i < nfiles; i++) {
+        files[i].fd = open(argv[optind + i], O_RDONLY);
+        if (files[i].fd == -1) {
+            handle_error("open fd failed", -1);
+        }
+        files[i].wd = inotify_add_watch(inotify_fd, argv[optind + i],
+                                        IN_MODIFY | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (files[i].wd == -1) {
+            handle_error("watch file failed", files[i].fd);
+        }
+        SUBMIT_FILE = i;
+        size_t file_skip = (skip > input_len) ? skip - input_len : 0;
+        if (FILTER != FILTER_NONE && file_skip > 0) {
+            shift_stream_tail(files[i].fd, 0, file_skip);   // the part encoded by the previous run
+        }
+        files[i].offset = submit_file(files[i].fd, file_skip, &pack, &id);
+        input_len += files[i].offset;
+    }
+    flush_pack(&pack, &id);
+
+    int watching = nfiles;
+    while (watching > 0) {
+        struct pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {signal_fd, POLLIN, 0}};
+        if (poll(fds, 2, -1) == -1) {
+            continue;       // EINTR
+        }
+        if (fds[1].revents & POLLIN) {
+            break;
+        }
+
+        // batch small appends, but keep within the latency target
+        long long deadline = now_ms() + FOLLOW_LATENCY_MS / 2;
+        watching = read_follow_events(inotify_fd, files, nfiles, watching);
+        while (follow_landed(files, nfiles) < CHUNK_SIZE && now_ms() < deadline
+               && poll(fds, 1, deadline - now_ms()) > 0) {
+            watching = read_follow_events(inotify_fd, files, nfiles, watching);
+        }
+
+        for (int i = 0; i < nfiles; i++) {
+            SUBMIT_FILE = i;
+            size_t size = submit_file(files[i].fd, files[i].offset, &pack, &id);
+            if (size < files[i].offset) {
+                fprintf(stderr, "nyuenc: %s: file truncated\n", argv[optind + i]);
+                size = submit_file(files[i].fd, 0, &pack, &id);
+                files[i].offset = 0;
+            }
+            input_len += size - files[i].offset;
+            files[i].offset = size;
+
+            if (files[i].closed) {
+                submit_flush(&pack, &id);
+                files[i].closed = false;
+            }
+        }
+        flush_pack(&pack, &id);
+    }
+
+    for (int i = 0; i < nfiles; i++) {
+        close(files[i].fd);
+    }
+    free(files);
+    close(inotify_fd);
+    close(signal_fd);
+
+    submit_poison(&pack, &id);
+    return input_len;
+}
+
+// Load the state of `--append-state` and prepare the output for continuing: the last pair (the trailing run)
+// is cut from the output and becomes the pending run of writer, so it merges with the first run of the new data.
+// Without a state file, the encoding starts from the beginning and the output must be empty.
+// Return the input offset already encoded.
+size_t load_append_state(const char *path, Writer *writer, int argc, char **argv) {
+    struct stat sb;
+    if (fstat(STDOUT_FILENO, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+        fprintf(stderr, "nyuenc: --append-state needs the output to be a regular file\n");
+        exit(EXIT_FAILURE);
+    }
+
+    AppendState state;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno != ENOENT) {
+            handle_error("open append state failed", -1);
+        }
+        if (sb.st_size != 0) {
+            fprintf(stderr, "nyuenc: no append state but the output is not empty\n");
+            exit(EXIT_FAILURE);
+        }
+        return 0;
+    }
+
+    if (fread(&state, sizeof(state), 1, file) != 1 || memcmp(state.magic, "NYUSTATE", 8) != 0) {
+        fprintf(stderr, "nyuenc: invalid append state %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+
+    // the new data has to continue the same stream, every option of the stream header must be the same
+    unsigned char header[HEADER_LEN];
+    stream_header(header);
+    if (memcmp(state.header, header, HEADER_LEN) != 0) {
+        fprintf(stderr, "nyuenc: --filter, --width, --entropy, --columnar, --base or --crc differs from the "
+                        "append state\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((uint64_t)sb.st_size != state.out_len) {
+        fprintf(stderr, "nyuenc: output has %zu bytes, append state expects %zu\n",
+                (size_t)sb.st_size, (size_t)state.out_len);
+        exit(EXIT_FAILURE);
+    }
+
+    // check the input still covers the encoded part before touching the output
+    size_t input_len = 0;
+    for (int arg = optind; arg < argc; arg++) {
+        struct stat input_sb;
+        if (stat(argv[arg], &input_sb) == -1) {
+            handle_error("get size failed", -1);
+        }
+        input_len += input_sb.st_size;
+    }
+    if (input_len < state.input_offset) {
+        fprintf(stderr, "nyuenc: input is shorter than the append state, it was truncated or replaced\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // rewrite the output from its last pair, this also works for `>>` (O_APPEND)
+    writer->out_len = state.out_len;
+    if (state.tail_count > 0) {
+        if (ftruncate(STDOUT_FILENO, state.out_len - PAIR_LEN) == -1
+            || lseek(STDOUT_FILENO, state.out_len - PAIR_LEN, SEEK_SET) == -1) {
+            handle_error("rewind output failed", -1);
+        }
+        writer->current_char = state.tail_char;
+        writer->current_count = state.tail_count;
+        writer->out_len = state.out_len - PAIR_LEN;
+    }
+
+    return state.input_offset;
+}
+
+// Save the state of `--append-state` after the output is written, replacing the old state file atomically
+void save_append_state(const char *path, Writer *writer, size_t input_offset) {
+    AppendState state = {0};
+    memcpy(state.magic, "NYUSTATE", 8);
+    state.input_offset = input_offset;
+    state.out_len = writer->out_len;
+    state.tail_char = writer->current_char;
+    state.tail_count = writer->current_count;
+    stream_header(state.header);
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    FILE *file = fopen(temp_path, "w");
+    if (file == NULL) {
+        handle_error("save append state failed", -1);
+    }
+    if (fwrite(&state, sizeof(state), 1, file) != 1 || fclose(file) != 0 || rename(temp_path, path) == -1) {
+        handle_error("save append state failed", -1);
+    }
+}
+
+// Reset the queue for the next job after its poison result is written. Every task, result and mapping is freed
+// by the writer already, and each `ready` semaphore in RESULT_QUEUE is back to 0 since the writer took every result
+// once.
+void finish_job() {
+    pthread_mutex_lock(&POOL.mutex);
+    POOL.submitted = 0;
+    POOL.processed = 0;
+    RETIRED_TASKS = 0;
+    pthread_mutex_unlock(&POOL.mutex);
+    memset(STREAM_TAIL, 0, MAX_STRIDE);
+    SUBMIT_OFFSET = 0;
+}
+
+
+
+/* Tuning: `--tune` encodes a sample of the inputs (TUNE_PIECES pieces spread over all files, TUNE_SAMPLE_LEN bytes)
+   with each `-j` (powers of 2 up to the CPUs) and `--chunk` (4, 16, 64KB), each run in a child nyuenc writing to
+   /dev/null, and saves the fastest for the host and the class of the data. `-j auto` finds the class of its inputs from
+   a few chunks and takes the saved configuration, nothing is timed again. */
+
+// Read `pieces` pieces of piece_len bytes spread evenly over the inputs (all files in order) into buf,
+// return the bytes read, all of the input if it is not longer
+size_t sample_inputs(int argc, char **argv, unsigned char *buf, size_t piece_len, size_t pieces) {
+    size_t total = 0;
+    struct stat sb;
+    for (int i = optind; i < argc; i++) {
+        if (stat(argv[i], &sb) == 0 && S_ISREG(sb.st_mode)) {
+            total += sb.st_size;
+        }
+    }
+    size_t step = (total > piece_len * pieces) ? total / pieces / CHUNK_SIZE * CHUNK_SIZE : piece_len;
+
+    size_t len = 0, base = 0, next = 0;
+    for (int i = optind; i < argc && len < piece_len * pieces; i++) {
+        int fd = open(argv[i], O_RDONLY);
+        if (fd == -1) {
+            continue;               // the encoder reports it
+        }
+        if (fstat(fd, &sb) == -1 || !S_ISREG(sb.st_mode)) {
+            close(fd);
+            continue;
+        }
+        for (; next < base + sb.st_size && len < piece_len * pieces; next += step) {
+            size_t want = (base + sb.st_size - next < piece_len) ? base + sb.st_size - next : piece_len;
+            ssize_t got = pread(fd, buf + len, want, next - base);
+            if (got <= 0) {
+                break;
+            }
+            len += got;
+        }
+        base += sb.st_size;
+        close(fd);
+    }
+    return len;
+}
+
+// Key of the data in the tuning cache: the class of a sample of the inputs (mostly zeros, runs, text-like or random)
+// and the options that change the cost of encoding it
+void data_class(int argc, char **argv, char *key, size_t key_len) {
+    unsigned char *buf = malloc(CLASS_PIECES * CHUNK_SIZE);
+    size_t len = sample_inputs(argc, argv, buf, CHUNK_SIZE, CLASS_PIECES);
+
+    size_t count[256] = {0}, repeats = 0;
+    for (size_t i = 0; i < len; i++) {
+        count[buf[i]]++;
+        repeats += i > 0 && buf[i] == buf[i - 1];
+    }
+    double entropy = 0;
+    for (int c = 0; c < 256; c++) {
+        if (count[c] > 0) {
+            entropy -= (double)count[c] / len * log2((double)count[c] / len);
+        }
+    }
+    free(buf);
+
+    const char *class = (len == 0) ? "empty" : (count[0] > len / 10 * 9) ? "sparse" : (repeats > len / 2) ? "runs"
+                                   : (entropy < 6) ? "text" : "random";
+    const char *format = ENTROPY ? "entropy" : COLUMNAR ? "columnar" : UNORDERED ? "unordered" : "pairs";
+    snprintf(key, key_len, "%s/w%d/f%d/%s%s%s", class, WIDTH, (int)FILTER, format, CRC ? "+crc" : "",
+             BASE_PATH != NULL ? "+base" : "");
+}
+
+// Path of the tuning cache of this host, `$XDG_CACHE_HOME/nyuenc/tune.<host>` (`~/.cache` by default),
+// its directories are created with create. Return false without a home.
+bool tune_cache_path(char *path, size_t len, bool create) {
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char host[256] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+
+    if (cache != NULL && cache[0] != '\0') {
+        snprintf(path, len, "%s", cache);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(path, len, "%s/.cache", home);
+    } else {
+        return false;
+    }
+    if (create) {
+        mkdir(path, 0755);
+    }
+    size_t n = strlen(path);
+    snprintf(path + n, len - n, "/nyuenc");
+    if (create) {
+        mkdir(path, 0755);
+    }
+    n = strlen(path);
+    snprintf(path + n, len - n, "/tune.%s", host);
+    return true;
+}
+
+// Look up the configuration saved by `--tune` for key, return false if there is none
+bool load_tuning(const char *key, int *threads, size_t *chunk_len) {
+    char path[PATH_MAX];
+    if (!tune_cache_path(path, sizeof(path), false)) {
+        return false;
+    }
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return false;
+    }
+
+    char line[512], name[256];
+    int t;
+    size_t kb;
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), file) != NULL) {
+        found = sscanf(line, "%255s %d %zu", name, &t, &kb) == 3 && strcmp(name, key) == 0 && t > 0
+                && kb > 0 && (kb << 10) % CHUNK_SIZE == 0 && (kb << 10) <= MAX_CHUNK_SIZE;
+    }
+    fclose(file);
+    if (found) {
+        *threads = t;
+        *chunk_len = kb << 10;
+    }
+    return found;
+}
+
+// Save the configuration of key as a line `key threads chunk-KB MB/s`, replacing the one saved before
+void save_tuning(const char *key, int threads, size_t chunk_len, double rate) {
+    char path[PATH_MAX], temp[PATH_MAX + 8];
+    if (!tune_cache_path(path, sizeof(path), true)) {
+        fprintf(stderr, "nyuenc: no HOME for the tuning cache\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *out = fopen(temp, "w");
+    if (out == NULL) {
+        handle_error("open tuning cache failed", -1);
+    }
+
+    // keep the lines of the other keys
+    FILE *in = fopen(path, "r");
+    char line[512], name[256];
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+        if (sscanf(line, "%255s", name) == 1 && strcmp(name, key) != 0) {
+            fputs(line, out);
+        }
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+
+    fprintf(out, "%s %d %zu %.1f\n", key, threads, chunk_len >> 10, rate);
+    if (fclose(out) != 0 || rename(temp, path) == -1) {
+        handle_error("write tuning cache failed", -1);
+    }
+}
+
+// Run a child nyuenc with args, its output going to /dev/null, return its seconds or -1 if it failed.
+// The child never hands its work to a daemon of NYUENC_SOCKET, that would time the daemon's `-j` and chunk.
+double tune_run(char **args) {
+    long long start = now_ns();
+    pid_t pid = fork();
+    if (pid == -1) {
+        handle_error("fork failed", -1);
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        unsetenv("NYUENC_SOCKET");
+        execv("/proc/self/exe", args);
+        _exit(127);
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return (now_ns() - start) / 1e9;
+}
+
+// `--tune`: time the grid on a sample of the inputs and save the fastest configuration for their class
+void tune(int argc, char **argv) {
+    char key[128];
+    data_class(argc, argv, key, sizeof(key));
+
+    // the sample goes into a memfd, so every configuration reads it from memory
+    unsigned char *sample = malloc(TUNE_SAMPLE_LEN);
+    size_t len = sample_inputs(argc, argv, sample, TUNE_SAMPLE_LEN / TUNE_PIECES, TUNE_PIECES);
+    if (len == 0) {
+        fprintf(stderr, "nyuenc: --tune found nothing to sample in the inputs\n");
+        exit(EXIT_FAILURE);
+    }
+    int fd = memfd_create("nyuenc-tune", 0);
+    if (fd == -1 || write(fd, sample, len) != (ssize_t)len) {
+        handle_error("write tuning sample failed", fd);
+    }
+    free(sample);
+
+    // the child takes the options given (but `--tune`), the later `-j` and `--chunk` win over any given
+    char jobs[16], chunk[16], sample_path[64];
+    snprintf(sample_path, sizeof(sample_path), "/proc/self/fd/%d", fd);
+    char *args[optind + 7];
+    int n = 0;
+    for (int i = 0; i < optind; i++) {
+        if (strcmp(argv[i], "--tune") != 0) {
+            args[n++] = argv[i];
+        }
+    }
+    args[n++] = "-j";
+    args[n++] = jobs;
+    args[n++] = "--chunk";
+    args[n++] = chunk;
+    args[n++] = "--";
+    args[n++] = sample_path;
+    args[n] = NULL;
+
+    int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int best_threads = 1;
+    size_t best_chunk = CHUNK_SIZE;
+    double best = 0;
+    for (int threads = 1; threads <= cpus; threads = (threads * 2 > cpus && threads < cpus) ? cpus : threads * 2) {
+        for (size_t chunk_len = CHUNK_SIZE; chunk_len <= MAX_CHUNK_SIZE; chunk_len *= 4) {
+            snprintf(jobs, sizeof(jobs), "%d", threads);
+            snprintf(chunk, sizeof(chunk), "%zu", chunk_len >> 10);
+
+            double seconds = -1;
+            for (int round = 0; round < TUNE_ROUNDS; round++) {
+                double t = tune_run(args);
+                if (t < 0) {
+                    fprintf(stderr, "nyuenc: --tune failed to encode the sample with -j %s --chunk %s\n", jobs, chunk);
+                    exit(EXIT_FAILURE);
+                }
+                seconds = (seconds < 0 || t < seconds) ? t : seconds;
+            }
+
+            double rate = len / seconds / (1 << 20);
+            fprintf(stderr, "nyuenc: -j %-3d --chunk %-2zu %10.1f MB/s\n", threads, chunk_len >> 10, rate);
+            if (rate > best) {
+                best = rate;
+                best_threads = threads;
+                best_chunk = chunk_len;
+            }
+        }
+    }
+    close(fd);
+
+    save_tuning(key, best_threads, best_chunk, best);
+    fprintf(stderr, "nyuenc: %s: -j %d --chunk %zu saved for -j auto\n", key, best_threads, best_chunk >> 10);
+}
+
+// Print the statistics of one file (or all files): size, runs, longest run, entropy, estimated compression ratio
+// and the distribution of run lengths
+void print_analysis(FILE *out, const char *name, Analysis *stats) {
+    uint64_t size = 0;
+    double entropy = 0;
+    for (int b = 0; b < 256; b++) {
+        size += stats->hist[b];
+    }
+    for (int b = 0; b < 256; b++) {
+        if (stats->hist[b] > 0) {
+            double p = (double)stats->hist[b] / size;
+            entropy -= p * log2(p);
+        }
+    }
+
+    fprintf(out, "%s: %llu bytes, %llu runs (mean %.2f, longest %llu), entropy %.3f bits/byte, "
+            "%llu bytes encoded (ratio %.3f)\n  runs:", name, (unsigned long long)size,
+            (unsigned long long)stats->num_runs, stats->num_runs ? (double)size / stats->num_runs : 0.0,
+            (unsigned long long)stats->longest, entropy, (unsigned long long)stats->pairs * 2,
+            stats->pairs ? (double)size / (stats->pairs * 2) : 0.0);
+    for (int bucket = 0; bucket < RUN_BUCKETS; bucket++) {
+        if (bucket == RUN_BUCKETS - 1) {
+            fprintf(out, " %d+:", 1 << bucket);
+        } else if (bucket == 0) {
+            fprintf(out, " 1:");
+        } else {
+            fprintf(out, " %d-%d:", 1 << bucket, (2 << bucket) - 1);
+        }
+        fprintf(out, "%.1f%%", stats->num_runs ? 100.0 * stats->runs[bucket] / stats->num_runs : 0.0);
+    }
+    fprintf(out, "\n");
+}
+
+// Count the runs of one pair kept by length in short_runs like any other run
+void count_short_runs(Analysis *stats) {
+    for (int len = 1; len < MAX_CHAR_LEN; len++) {
+        uint64_t n = stats->short_runs[len];
+        if (n > 0) {
+            int bucket = 31 - __builtin_clz(len);
+            stats->runs[bucket < RUN_BUCKETS ? bucket : RUN_BUCKETS - 1] += n;
+            stats->num_runs += n;
+            stats->pairs += n;
+            stats->longest = ((uint64_t)len > stats->longest) ? (uint64_t)len : stats->longest;
+            stats->short_runs[len] = 0;
+        }
+    }
+}
+
+// Add the statistics of part to stats
+void add_analysis(Analysis *stats, const Analysis *part) {
+    for (int b = 0; b < 256; b++) {
+        stats->hist[b] += part->hist[b];
+    }
+    for (int bucket = 0; bucket < RUN_BUCKETS; bucket++) {
+        stats->runs[bucket] += part->runs[bucket];
+    }
+    for (int len = 1; len < MAX_CHAR_LEN; len++) {
+        stats->short_runs[len] += part->short_runs[len];
+    }
+    stats->num_runs += part->num_runs;
+    stats->pairs += part->pairs;
+    stats->longest = (part->longest > stats->longest) ? part->longest : stats->longest;
+}
+
+// Merge the statistics of workers for each file with the runs joined by the writer and report them, to `stdout` with
+// `--analyze-only`. The total of a stream has the runs joined over files, the outputs of `--batch` are apart.
+void report_analysis(int argc, char **argv, int num_threads) {
+    FILE *out = ANALYZE_ONLY ? stdout : stderr;
+    Analysis *all = calloc(1, sizeof(Analysis));
+    Analysis *file = malloc(sizeof(Analysis));
+
+    for (int f = 0; f < argc - optind; f++) {
+        memset(file, 0, sizeof(Analysis));
+        for (int t = 0; t < num_threads; t++) {
+            if ((size_t)f < NUM_ANALYSIS[t]) {
+                add_analysis(file, &ANALYSIS[t][f]);
+            }
+        }
+        count_short_runs(file);
+        add_analysis(all, file);
+        add_analysis(file, &JOINED[f]);
+        if (BATCH_DIR != NULL) {
+            add_analysis(all, &JOINED[f]);
+        }
+
+        print_analysis(out, argv[optind + f], file);
+    }
+
+    if (argc - optind > 1) {
+        if (BATCH_DIR == NULL) {
+            add_analysis(all, &JOINED_TOTAL);
+        }
+        print_analysis(out, "total", all);
+    }
+
+    for (int t = 0; t < num_threads; t++) {
+        free(ANALYSIS[t]);
+    }
+    free(ANALYSIS);
+    free(NUM_ANALYSIS);
+    free(JOINED);
+    free(file);
+    free(all);
+}
+
+
+
+#define OPT(o) (1u << OPTION_##o)
+
+const Option OPTIONS[NUM_OPTIONS] = {
+    [OPTION_ANALYZE] = {"--analyze",
+        OPT(WIDTH),
+        "--analyze counts bytes", false},
+    [OPTION_COLUMNAR] = {"--columnar",
+        OPT(ENTROPY) | OPT(CRC) | OPT(UNORDERED) | OPT(VERIFY) | OPT(SHARD) | OPT(CACHE),
+        "--columnar writes blocks of columns", false},
+    [OPTION_CRC] = {"--crc",
+        OPT(ENTROPY) | OPT(UNORDERED) | OPT(VERIFY) | OPT(SHARD),
+        "--crc frames the pairs of each task", false},
+    [OPTION_UNORDERED] = {"--unordered",
+        OPT(ENTROPY) | OPT(SERVE) | OPT(APPEND_STATE) | OPT(ANALYZE_ONLY) | OPT(VERIFY) | OPT(BATCH)
+        | OPT(SHARD),
+        "--unordered writes records of pairs to stdout", false},
+    // the trials pass their options on, a warm cache or the reports would skew the later trials
+    [OPTION_TUNE] = {"--tune",
+        OPT(FOLLOW) | OPT(INPUT_SOURCES) | OPT(SERVE) | OPT(APPEND_STATE) | OPT(BATCH) | OPT(SHARD) | OPT(SHM)
+        | OPT(VERIFY) | OPT(CACHE) | OPT(PERF) | OPT(LATENCY) | OPT(ANALYZE),
+        "--tune times plain encoding of a sample of the files given", false},
+    [OPTION_SHM] = {"--shm",
+        OPT(SERVE) | OPT(APPEND_STATE) | OPT(ANALYZE_ONLY) | OPT(VERIFY) | OPT(BATCH) | OPT(SHARD)
+        | OPT(UNORDERED),
+        "--shm replaces the output on stdout", false},
+    [OPTION_SHARD] = {"--shard",
+        OPT(FILTER) | OPT(WIDTH) | OPT(ENTROPY) | OPT(BASE) | OPT(FOLLOW) | OPT(SERVE) | OPT(APPEND_STATE)
+        | OPT(ANALYZE_ONLY) | OPT(VERIFY) | OPT(BATCH) | OPT(INPUT_SOURCES),
+        "--shard writes plain pairs of a range of argv", false},
+    [OPTION_INPUT_SOURCES] = {"-r/-@",
+        OPT(FOLLOW) | OPT(SERVE) | OPT(APPEND_STATE) | OPT(ANALYZE) | OPT(VERIFY),
+        "-r or -@ finds the inputs while encoding", false},
+    [OPTION_BATCH] = {"--batch",
+        OPT(FOLLOW) | OPT(SERVE) | OPT(APPEND_STATE) | OPT(ANALYZE_ONLY) | OPT(VERIFY),
+        "--batch writes a file for each input", false},
+    [OPTION_VERIFY] = {"--verify",
+        OPT(FOLLOW) | OPT(SERVE) | OPT(APPEND_STATE) | OPT(ANALYZE_ONLY),
+        "--verify checks the output of one run", false},
+    [OPTION_FOLLOW] = {"-f", 0, NULL, false},
+    [OPTION_SERVE] = {"--serve", 0, NULL, false},
+    [OPTION_APPEND_STATE] = {"--append-state", 0, NULL, false},
+    [OPTION_ANALYZE_ONLY] = {"--analyze-only", 0, NULL, false},
+    [OPTION_FILTER] = {"--filter", 0, NULL, false},
+    [OPTION_WIDTH] = {"--width", 0, NULL, false},
+    [OPTION_ENTROPY] = {"--entropy", 0, NULL, false},
+    [OPTION_BASE] = {"--base", 0, NULL, false},
+    [OPTION_CACHE] = {"--cache", 0, NULL, false},
+    [OPTION_PERF] = {"--perf", 0, NULL, false},
+    [OPTION_LATENCY] = {"--latency", 0, NULL, false},
+    [OPTION_HUGE_PAGES] = {"--hugepages", 0, NULL, false},
+    [OPTION_THP_INPUT] = {"--thp-input", 0, NULL, false},
+    [OPTION_CHUNK] = {"--chunk", 0, NULL, false},
+};
+
+// Bits of the options given, a `--chunk` of the default size is no change
+unsigned options_given(void) {
+    bool given[NUM_OPTIONS] = {
+        [OPTION_ANALYZE] = ANALYZE,
+        [OPTION_COLUMNAR] = COLUMNAR,
+        [OPTION_CRC] = CRC,
+        [OPTION_UNORDERED] = UNORDERED,
+        [OPTION_TUNE] = TUNE,
+        [OPTION_SHM] = SHM_NAME != NULL,
+        [OPTION_SHARD] = SHARD_COUNT > 0,
+        [OPTION_INPUT_SOURCES] = NUM_INPUT_SOURCES > 0,
+        [OPTION_BATCH] = BATCH_DIR != NULL,
+        [OPTION_VERIFY] = VERIFY,
+        [OPTION_FOLLOW] = FOLLOW,
+        [OPTION_SERVE] = SERVE_PATH != NULL,
+        [OPTION_APPEND_STATE] = APPEND_STATE_PATH != NULL,
+        [OPTION_ANALYZE_ONLY] = ANALYZE_ONLY,
+        [OPTION_FILTER] = FILTER != FILTER_NONE,
+        [OPTION_WIDTH] = WIDTH != 8,
+        [OPTION_ENTROPY] = ENTROPY,
+        [OPTION_BASE] = BASE_PATH != NULL,
+        [OPTION_CACHE] = CACHE_PATH != NULL,
+        [OPTION_PERF] = PERF,
+        [OPTION_LATENCY] = LATENCY,
+        [OPTION_HUGE_PAGES] = HUGE_PAGES,
+        [OPTION_THP_INPUT] = THP_INPUT,
+        [OPTION_CHUNK] = CHUNK_LEN != 0 && CHUNK_LEN != CHUNK_SIZE,
+    };
+    unsigned bits = 0;
+    for (int o = 0; o < NUM_OPTIONS; o++) {
+        bits |= given[o] ? (1u << o) : 0;
+    }
+    return bits;
+}
+
+// Exit with the reason of the first option given with one it can not be used with, listing all of those
+void check_options(unsigned given) {
+    for (int o = 0; o < NUM_OPTIONS; o++) {
+        unsigned forbidden = OPTIONS[o].forbidden;
+        if (!(given & (1u << o)) || !(given & forbidden)) {
+            continue;
+        }
+
+        fprintf(stderr, "nyuenc: %s, it can not be used with ", OPTIONS[o].reason);
+        int left = __builtin_popcount(forbidden);
+        for (int f = 0; f < NUM_OPTIONS; f++) {
+            if (forbidden & (1u << f)) {
+                left--;
+                fprintf(stderr, "%s%s", OPTIONS[f].name, (left > 1) ? ", " : (left == 1) ? " or " : "\n");
+            }
+        }
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Whether a daemon of `--serve` encodes the same as this run with all of the options given
+bool options_served(unsigned given) {
+    for (int o = 0; o < NUM_OPTIONS; o++) {
+        if ((given & (1u << o)) && !OPTIONS[o].served) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+
+    int tool_status = run_tool(argc, argv);
+    if (tool_status != -1) {
+        return tool_status;
+    }
+
+    int num_threads = parsing_j(argc, argv);
+    check_options(options_given());
+    if (TUNE) {
+        tune(argc, argv);
+        return 0;
+    }
+
+    // `-j auto` (and the chunk unless `--chunk` is given) as tuned for this host and the class of the data
+    if (JOBS_AUTO) {
+        char key[128];
+        data_class(argc, argv, key, sizeof(key));
+        size_t chunk_len;
+        if (load_tuning(key, &num_threads, &chunk_len)) {
+            CHUNK_LEN = (CHUNK_LEN == 0) ? chunk_len : CHUNK_LEN;
+        } else {
+            num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+            fprintf(stderr, "nyuenc: nothing tuned for %s on this host (see --tune), -j %d\n", key, num_threads);
+        }
+    }
+    if (CHUNK_LEN == 0) {
+        CHUNK_LEN = CHUNK_SIZE;
+    }
+
+    if (BATCH_DIR != NULL && mkdir(BATCH_DIR, 0777) == -1 && errno != EEXIST) {
+        handle_error("create output directory failed", -1);
+    }
+    Writer writer = {.out = stdout, .flush_when_idle = FOLLOW};
+
+    // thin client: let a running `nyuenc --serve` daemon encode the files if there is one
+    const char *socket_path = getenv("NYUENC_SOCKET");
+    if (socket_path != NULL && options_served(options_given())) {
+        int status = request_daemon(socket_path, argc, argv);
+        if (status != -1) {
+            return status;
+        }
+    }
+
+    // initialize mutex and condition variable for task queue
+    pthread_mutex_init(&POOL.mutex, NULL);
+    pthread_cond_init(&POOL.cond, NULL);
+
+    // rings and the arena of tasks and results, on 2MB pages with `--hugepages`
+    open_rings();
+    if (HUGE_PAGES) {
+        open_arena();
+    }
+
+    // initialize the `ready` sem of each slot in RESULT_QUEUE
+    for (int i = 0; i < MAX_TASK_NUM; i++) {
+        sem_init(&RESULT_QUEUE[i].ready, 0, 0);
+    }
+    sem_init(&POOL.free_slots, 0, MAX_TASK_NUM);
+
+    // follow mode ends on SIGINT/SIGTERM through a signalfd, block them before threads inherit the mask
+    if (FOLLOW) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    }
+
+    // counters of each worker and the writer
+    if (PERF) {
+        NUM_PERF_THREADS = num_threads + 1;
+        PERF_THREADS = line_alloc(NUM_PERF_THREADS, sizeof(PerfThread));
+    }
+
+    // histograms of each worker and the writer, dumped periodically with `--latency=ms`
+    pthread_t latency_thread;
+    if (LATENCY) {
+        NUM_LATENCY_THREADS = num_threads + 1;
+        LATENCY_THREADS = line_alloc(NUM_LATENCY_THREADS, sizeof(LatencyThread));
+        if (LATENCY_INTERVAL_MS > 0 && pthread_create(&latency_thread, NULL, latency_process, NULL) != 0) {
+            handle_error("Failed to create thread", -1);
+        }
+    }
+
+    // statistics of each worker, grown for each file by the worker itself
+    if (ANALYZE) {
+        ANALYSIS = calloc(num_threads, sizeof(Analysis *));
+        NUM_ANALYSIS = calloc(num_threads, sizeof(size_t));
+        JOINED = calloc(argc - optind, sizeof(Analysis));
+    }
+
+    // workers of `--unordered` write records from the start, the header has to go out before them
+    if (UNORDERED) {
+        write_header(&writer);
+        fflush(writer.out);
+    }
+
+    // initialize threads pool and create threads
+    pthread_t threads[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, thread_process, (void *)(intptr_t)i) != 0) {
+            handle_error("Failed to create thread", -1);
+        }
+    }
+
+    if (CACHE_PATH != NULL) {
+        open_cache(CACHE_PATH);
+    }
+    if (BASE_PATH != NULL) {
+        open_base(BASE_PATH);
+    }
+
+    if (SERVE_PATH != NULL) {
+        serve(SERVE_PATH);
+    }
+
+    size_t skip = 0;
+    if (APPEND_STATE_PATH != NULL) {
+        skip = load_append_state(APPEND_STATE_PATH, &writer, argc, argv);
+    }
+
+    // verifier threads check what the writer writes through a tee on `stdout`
+    pthread_t verify_threads[num_threads];
+    Tee tee = {0};
+    if (VERIFY) {
+        verify_open(argc, argv);
+        for (int i = 0; i < num_threads; i++) {
+            if (pthread_create(&verify_threads[i], NULL, verify_process, NULL) != 0) {
+                handle_error("Failed to create thread", -1);
+            }
+        }
+        writer.out = fopencookie(&tee, "w", (cookie_io_functions_t){.write = tee_write, .close = tee_close});
+        if (writer.out == NULL) {
+            handle_error("open verify stream failed", -1);
+        }
+    }
+
+    // the output goes into the ring of `--shm` instead
+    ShmOutput shm = {0};
+    if (SHM_NAME != NULL) {
+        writer.out = shm_open_output(&shm, SHM_NAME);
+    }
+
+    // outputs of `--batch` are written by the workers, there is no writer thread
+    size_t input_len = 0;
+    if (BATCH_DIR != NULL) {
+        input_len = batch_files(argc, argv, num_threads);
+    } else {
+        pthread_t writer_thread;
+        if (pthread_create(&writer_thread, NULL, writer_process, &writer) != 0) {
+            handle_error("Failed to create thread", -1);
+        }
+
+        size_t shard_offset = 0;
+        if (SHARD_COUNT > 0) {
+            input_len = shard_files(argc, argv, &shard_offset);
+        } else {
+            input_len = FOLLOW ? follow_files(argc, argv, skip) : create_tasks_from_file(argc, argv, skip);
+        }
+
+        pthread_join(writer_thread, NULL);
+        if (SHARD_COUNT > 0) {
+            write_shard_footer(&writer, shard_offset, input_len);
+        }
+    }
+    if (VERIFY || SHM_NAME != NULL) {
+        if (fclose(writer.out) != 0) {
+            handle_error("write output failed", -1);
+        }
+    }
+    if (VERIFY) {
+        verify_finish(verify_threads, num_threads);
+    }
+    report_cache();
+    finish_job();
+
+    if (APPEND_STATE_PATH != NULL) {
+        if (fflush(stdout) != 0) {
+            handle_error("write output failed", -1);
+        }
+        save_append_state(APPEND_STATE_PATH, &writer, input_len);
+    }
+
+    // shut down the threads pool and join all worker threads
+    pthread_mutex_lock(&POOL.mutex);
+    POOL.all_processed = true;
+    pthread_cond_broadcast(&POOL.cond);
+    pthread_mutex_unlock(&POOL.mutex);
+    for (int i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (PERF) {
+        report_perf(num_threads);
+        free(PERF_THREADS);
+    }
+
+    if (ANALYZE) {
+        report_analysis(argc, argv, num_threads);
+    }
+
+    if (LATENCY) {
+        if (LATENCY_INTERVAL_MS > 0) {
+            pthread_mutex_lock(&LATENCY_MUTEX);
+            LATENCY_DONE = true;
+            pthread_cond_signal(&LATENCY_COND);
+            pthread_mutex_unlock(&LATENCY_MUTEX);
+            pthread_join(latency_thread, NULL);
+        }
+        report_latency();
+        free(LATENCY_THREADS);
+    }
+
+    // clean mutex, condition variable and semaphores 
+    pthread_mutex_destroy(&POOL.mutex);
+    pthread_cond_destroy(&POOL.cond);
+    for (int i = 0; i < MAX_TASK_NUM; i++) {
+        sem_destroy(&RESULT_QUEUE[i].ready);
     }
+    sem_destroy(&POOL.free_slots);
 
     return 0;
 }
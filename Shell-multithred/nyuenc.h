@@ -0,0 +1,467 @@
+// nyuenc.h: the constants, structs and globals shared by the translation units of nyuenc, and what each of
+// them calls in the others.
+
+#ifndef NYUENC_H
+#define NYUENC_H
+
+#define _GNU_SOURCE         // SEEK_DATA, SEEK_HOLE, getopt_long
+
+#include <stdio.h>          // stderr, stdout, perror, fwrite, fprintf
+#include <stdlib.h>         // exit, EXIT_FAILURE, EXIT_SUCCESS, malloc
+#include <stdbool.h>        // used for POOL.all_processed
+#include <unistd.h>         // lseek, close, pwrite
+#include <errno.h>          // errno, ENXIO
+
+#include <semaphore.h>      // sem_init, sem_post, sem_wait
+#include <string.h>         // memcpy
+#include <limits.h>         // UINT_MAX
+#include <stdint.h>         // uint64_t, uint32_t
+#include <stddef.h>         // offsetof
+#include <math.h>           // log2
+#include <sys/mman.h>       // mmap
+#include <sys/stat.h>       // fstat
+#include <fcntl.h>          // open, O_*
+#include <pthread.h>        // pthread_t, pthread_create, phthread_exit, pthread_join
+#include <getopt.h>         // getopt_long
+#include <signal.h>         // signal, SIGPIPE
+#include <sys/socket.h>     // socket, bind, listen, accept, sendmsg, recvmsg, SCM_RIGHTS
+#include <sys/un.h>         // sockaddr_un
+#include <sys/inotify.h>    // inotify_init1, inotify_add_watch
+#include <sys/signalfd.h>   // signalfd
+#include <poll.h>           // poll
+#include <time.h>           // clock_gettime
+#include <sys/ioctl.h>      // ioctl
+#include <sys/syscall.h>    // SYS_perf_event_open
+#include <linux/perf_event.h>   // perf_event_attr, PERF_*
+#include <dirent.h>         // DT_DIR, DT_REG, DT_UNKNOWN
+#include <sys/wait.h>       // waitpid
+#include "nyuring.h"        // NyuRingHeader, the ring of `--shm`
+#if defined(__x86_64__)
+#include <nmmintrin.h>      // _mm_crc32_u64, _mm_crc32_u8
+#endif
+
+
+#define CHUNK_SIZE 4096     // Chunk size set to 4KB (4096 Bytes)
+#define MAX_CHUNK_SIZE (64 << 10)   // largest chunk of `--chunk`, stack buffers of a task grow with its chunk
+#define MAX_CHAR_LEN 255    // no character will appear more than 255 times in a row
+#define MAX_TASK_NUM 16384  // tasks in flight, TASK_QUEUE and RESULT_QUEUE are rings of this size (1MB of slots)
+#define FLUSH_TASK (UINT_MAX - 1)   // start and end of a flush task, the writer writes its pending run on it
+#define FOLLOW_LATENCY_MS 50        // appended data is encoded and written within about this time with `-f`
+#define PERF_EVENTS 5       // cycles, instructions, branch-misses, LLC-misses, dTLB-misses
+#define PERF_PHASES 3       // encode, wait on POOL.cond, merge in writer
+#define HIST_SUB_BITS 3     // latency histograms have 2^3 linear sub-buckets per power of 2 (12.5% precision)
+#define HIST_BUCKETS 512    // enough for any 64-bit nanoseconds
+#define RUN_BUCKETS 10      // run lengths by power of 2 for `--analyze`: 1, 2-3, 4-7, ..., 256+
+#define CACHE_SLOTS 65536   // slots of the chunk cache for 4KB chunks (256MB of input), fewer for a larger `--chunk`
+#define MAX_SERVE_FDS 250   // fds passed in one request to `nyuenc --serve`, below the kernel SCM_MAX_FD (253)
+#define MAX_STRIDE 64       // longest record of the stride filters of `--filter`
+#define HEADER_LEN 8        // stream header for `--filter` and `--width`: "\0\0NYU", filter id, stride, width
+#define MAX_PAIR_LEN 9      // `<element, count>` pair of `--width=64`
+#define MAX_CODE_LEN 15     // longest Huffman code of `--entropy`, code lengths are stored as 4 bits
+#define FRAME_HEAD_LEN 5    // frame type and body length of `--entropy`
+#define LOOKUP_BITS 10      // codes up to this length are decoded with one table lookup
+#define VERIFY_SEGMENT (1 << 16)    // bytes of output in one segment checked by a verifier thread
+#define VERIFY_SEGMENTS 64  // segments waiting for verifier threads, the writer waits beyond this
+#define MAX_BATCH_OPEN 256  // outputs of `--batch` open at once, the submitter waits beyond this
+#define INPUT_RING_SIZE 4096        // paths found by `-r` and `-@` not submitted yet, the walk waits beyond this
+#define DIRENT_BUFFER (1 << 16)     // bytes of directory entries read by one getdents64()
+#define HUGE_PAGE_SIZE (2 << 20)    // pages of `--hugepages`, also the blocks of the arena
+#define ARENA_HEADER 64     // ArenaBlock at the start of each block, allocations come after it
+#define SHM_SLOTS 32        // slots of the ring of `--shm`, a power of 2
+#define SHM_SLOT_SIZE (1 << 20)     // bytes of each slot, the output stream is buffered by slots
+#define CACHE_LINE 64       // state written by different threads is kept on different lines of this size
+#define COLUMN_HEAD_LEN 12  // block of `--columnar`: runs, length of the hole
+#define CRC_HEAD_LEN 20     // frame of `--crc`: input length, body length, CRC32C of the input and of the body
+#define CRC32C_POLY 0x82F63B78      // CRC32C (Castagnoli) polynomial, reflected
+#define RECORD_HEAD_LEN 28  // record of `--unordered`: sequence id, input offset, input length, length of pairs
+#define TUNE_SAMPLE_LEN (32 << 20)  // bytes of the inputs encoded by each configuration of `--tune`
+#define TUNE_PIECES 64      // the sample of `--tune` is this many pieces spread over the inputs
+#define TUNE_ROUNDS 2       // runs of each configuration of `--tune`, the fastest counts
+#define CLASS_PIECES 64     // chunks read to find the class of the data for `--tune` and `-j auto`
+
+
+
+// Mapping struct for a mapped file, unmapped when the writer has written the last task referring to it
+typedef struct {
+    char *addr;
+    size_t len;
+    int refs;
+    size_t base;                        // First byte submitted from the mapping, with `--filter`
+    unsigned char prev[MAX_STRIDE];     // Input right before base, with `--filter`
+    size_t offset;                      // Offset of base in the input, with `--base`
+} Mapping;
+
+// Task struct for mapped address, start index, end index and id
+// a task with NULL addr covers a hole of the file, which is encoded as a zero run without reading it
+typedef struct {
+    const char *addr;
+    size_t start;
+    size_t end;
+    size_t id;
+    char *pack;                         // Heap buffer of a composite task (several small files), or NULL
+    Mapping *map;                       // Mapping the addr belongs to, or NULL
+    uint64_t submit_ns;                 // Time of submission with `--latency`
+    size_t file;                        // Index of the input file with `--analyze`
+    size_t base;                        // First index of addr in this submission, bytes before it are in prev
+    unsigned char prev[MAX_STRIDE];     // Input right before base with `--filter`
+    size_t offset;                      // Offset of start in the input (all files in order) with `--base`
+    struct BatchFile *batch;            // Output of the file with `--batch`, or NULL
+} Task;
+
+// Pack struct for collecting small files into one composite task up to CHUNK_SIZE
+typedef struct {
+    char *buffer;
+    size_t len;
+    unsigned char prev[MAX_STRIDE];     // Input right before the pack with `--filter`
+    size_t offset;                      // Offset of the pack in the input with `--base`
+} Pack;
+
+// InputSource struct for `-r dir` (a tree to walk) or `-@ list` (a file of paths, `-` for stdin)
+typedef struct {
+    char type;                          // 'r' or '@'
+    const char *arg;
+} InputSource;
+
+// ArenaBlock struct at the start of each 2MB block of the arena of `--hugepages`
+typedef struct {
+    int live;                           // Allocations not freed yet, plus one while a thread allocates from it
+    size_t used;                        // Bytes of the block given out, from the start of the block
+} ArenaBlock;
+
+// WalkDir struct for a directory of `-r` not walked yet
+typedef struct WalkDir {
+    char *path;
+    struct WalkDir *next;
+} WalkDir;
+
+// Request struct sent by a client to `nyuenc --serve`, followed by `nfiles + 1` fds (output first) as SCM_RIGHTS
+typedef struct {
+    unsigned int nfiles;
+} Request;
+
+// CacheSlot struct for one chunk in the chunk cache file, keyed by the content hash of the chunk
+typedef struct {
+    uint32_t seq;                       // Odd while the slot is being written
+    uint32_t src_len;                   // Length of the chunk
+    uint64_t hash;                      // Content hash of the chunk, 0 for an empty slot
+    uint32_t len;                       // Length of pairs
+    unsigned char pairs[];              // 2 * chunk_size of the cache, the pairs of a chunk with no run
+} CacheSlot;
+
+// Cache struct for the header of the chunk cache file, followed by num_slots slots of cache_slot_len() bytes
+typedef struct {
+    char magic[8];                      // "NYUCACHE"
+    uint32_t chunk_size;                // CHUNK_LEN the cache was made for
+    uint32_t num_slots;
+    _Alignas(8) unsigned char slots[];
+} Cache;
+
+// Writer struct for the output stream and the pending run, which is merged with the next result before it is written
+typedef struct {
+    FILE *out;
+    uint64_t current_char;              // Char, or element of `--width` (little endian)
+    size_t current_count;
+    size_t out_len;                     // Bytes written to out
+    bool flush_when_idle;               // Flush out whenever the next result is not ready yet (`-f`)
+    uint64_t run_len;                   // Count of the current run, including pairs written, for `--shard`
+    uint64_t head_count;                // First run once it has ended, 0 before
+    unsigned char head_char;
+    unsigned char analyze_char;         // Run of `--analyze` not ended yet, joined over the results in order
+    uint64_t analyze_run;               // Its length in analyze_file
+    uint64_t analyze_total;             // Its length over the ends of files, for the total of the stream
+    size_t analyze_file;
+} Writer;
+
+// BatchFile struct for the output of one input with `--batch`, written by whichever worker finishes its next task
+typedef struct BatchFile {
+    Writer writer;
+    pthread_mutex_t lock;               // Held while writing, one worker writes a file at a time
+    size_t next;                        // Id of the next task to write
+    size_t end;                         // Id after the last task, SIZE_MAX while the file is being submitted
+    size_t index;                       // Index of the input file
+    size_t input_len;
+    char *input;
+    char *output;
+} BatchFile;
+
+// Follow struct for an input followed by `-f`
+typedef struct {
+    int fd;
+    int wd;                             // inotify watch descriptor, -1 once the file is deleted or moved
+    size_t offset;                      // Bytes of the file submitted so far
+    bool closed;                        // The file was closed by its writer since last batch
+} Follow;
+
+// AppendState struct saved by `--append-state` for continuing the encoding of growing inputs
+typedef struct {
+    char magic[8];                      // "NYUSTATE"
+    uint64_t input_offset;              // Bytes of input encoded so far
+    uint64_t out_len;                   // Bytes of output so far, the last pair is the trailing run
+    uint64_t tail_char;                 // Trailing run, merged with the first run of the new data
+    unsigned char tail_count;
+    unsigned char header[HEADER_LEN];   // Stream header of the output (mode, filter, stride, width), must not change
+} AppendState;
+
+// ShardFooter struct written after the pairs of `--shard i/N`, read by `nyuenc stitch`
+typedef struct {
+    char magic[8];                      // "NYUSHARD"
+    uint32_t index;
+    uint32_t count;
+    uint64_t input_offset;              // Range of the input (all files in order) encoded by the shard
+    uint64_t input_len;
+    uint64_t head_count;                // First run of the shard
+    uint64_t tail_count;                // Last run of the shard, 0 if the shard is one run
+    unsigned char head_char;
+    unsigned char tail_char;
+} ShardFooter;
+
+// PerfThread struct for the hardware counters of one thread with `--perf`, summed per phase, on its own cache lines
+typedef struct {
+    _Alignas(CACHE_LINE) int leader;    // Group leader fd (cycles), -1 if counters are not available
+    int fds[PERF_EVENTS];
+    int index[PERF_EVENTS];             // Position of each event in the group read, -1 if not available
+    uint64_t start[PERF_EVENTS];        // Counters at the beginning of current phase
+    uint64_t total[PERF_PHASES][PERF_EVENTS];
+    uint64_t bytes[PERF_PHASES];        // Input bytes passed through each phase
+} PerfThread;
+
+enum { PHASE_ENCODE, PHASE_WAIT, PHASE_MERGE };
+
+// Histogram struct for a log-linear latency histogram in nanoseconds, only written by its own thread
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t max;
+} Histogram;
+
+// LatencyThread struct for the histograms of one thread with `--latency`, on its own cache lines
+typedef struct {
+    _Alignas(CACHE_LINE) Histogram encode;   // Time of encoder() for a task (workers)
+    Histogram wait;                     // From submission until a worker picks the task up (workers)
+    Histogram order;                    // From ready until the writer consumes the result (writer)
+} LatencyThread;
+
+// ToolWork struct for a part of a pair stream processed by one thread of `nyuenc size` or `nyuenc hist`
+typedef struct {
+    const unsigned char *pairs;
+    size_t len;                         // Bytes of pairs, even
+    uint64_t total;                     // Sum of counts (size)
+    uint64_t hist[256];                 // Sum of counts for each byte (hist)
+    off_t offset;                       // Offset of the part in `stdout` (cat, stitch)
+} ToolWork;
+
+// Analysis struct for the run statistics of one input file with `--analyze`, kept by each worker
+typedef struct {
+    uint64_t hist[256];                 // Bytes of each value, for the entropy
+    uint64_t runs[RUN_BUCKETS];         // Runs by length
+    uint64_t short_runs[MAX_CHAR_LEN];  // Runs of one pair by length, added to runs when reported
+    uint64_t num_runs;
+    uint64_t longest;                   // Longest run
+    uint64_t pairs;                     // Pairs of the output, runs split at MAX_CHAR_LEN
+} Analysis;
+
+// Filter struct for a pre-filter of `--filter`: out[i] = in[i] op in[i - stride], and its inverse for decoding
+typedef struct {
+    const char *name;
+    void (*apply)(unsigned char *out, const unsigned char *in, size_t len, const unsigned char *before, size_t stride);
+    void (*invert)(unsigned char *data, size_t len, size_t stride);
+} Filter;
+
+enum { FILTER_NONE, FILTER_DELTA, FILTER_XOR, NUM_FILTERS };
+
+// Options that change how a run goes, `OPT(x)` is the bit of OPTION_x in the options given
+enum {
+    OPTION_ANALYZE, OPTION_COLUMNAR, OPTION_CRC, OPTION_UNORDERED, OPTION_TUNE, OPTION_SHM, OPTION_SHARD,
+    OPTION_INPUT_SOURCES, OPTION_BATCH, OPTION_VERIFY, OPTION_FOLLOW, OPTION_SERVE, OPTION_APPEND_STATE,
+    OPTION_ANALYZE_ONLY, OPTION_FILTER, OPTION_WIDTH, OPTION_ENTROPY, OPTION_BASE, OPTION_CACHE, OPTION_PERF,
+    OPTION_LATENCY, OPTION_HUGE_PAGES, OPTION_THP_INPUT, OPTION_CHUNK, NUM_OPTIONS
+};
+
+// Option struct for an option and the options it can not be used with, checked in the order of the enum
+typedef struct {
+    const char *name;                   // As listed in the messages
+    unsigned forbidden;                 // Bits of the options it can not be used with
+    const char *reason;                 // Why, for the message of a conflict
+    bool served;                        // A daemon of `--serve` encodes the same with it, so the thin client can pass
+} Option;
+
+// StreamHeader struct for the header of an encoded file, as read by the tools
+typedef struct {
+    size_t len;                         // HEADER_LEN, or 0 for a plain stream of `<char, count>` pairs
+    int filter;
+    size_t stride;
+    int width;                          // Bits of an element
+    bool entropy;                       // Frames of `--entropy` instead of pairs
+    bool base;                          // XORed with the base file of `--base`
+    bool records;                       // Records of `--unordered` instead of pairs
+    bool crc;                           // Frames of `--crc` around the pairs
+    bool columnar;                      // Blocks of `--columnar` instead of pairs
+} StreamHeader;
+
+// Frame types of `--entropy`: pairs of one task as is, Huffman coded, or a hole as a count of zero elements
+enum { FRAME_PAIRS, FRAME_HUFFMAN, FRAME_ZERO };
+
+// Huffman struct for the canonical code of one alphabet, pair elements or pair counts
+typedef struct {
+    unsigned char lengths[256];
+    uint16_t codes[256];
+    uint16_t count[MAX_CODE_LEN + 1];   // Codes of each length, for decoding
+    unsigned char sorted[256];          // Symbols by code, for decoding
+} Huffman;
+
+// Result struct for collecting result for each task in buffer with its length
+typedef struct {
+    unsigned char *buffer;              // Result char buffer (e.g. "a1b2c3" char[])
+    size_t len;                         // Length of buffer ("a255b255c255" = 6, )
+    size_t zero_run;                    // Length of the hole this result stands for (buffer is NULL)
+    uint64_t ready_ns;                  // Time the result was ready with `--latency`
+    uint64_t head_run;                  // First run of the task with `--analyze` (the whole task if it is one run)
+    uint64_t tail_run;                  // Last run of the task with `--analyze`, 0 if it is one run
+    unsigned char head_char;
+    unsigned char tail_char;
+} Result;
+
+// Completion struct for a slot of RESULT_QUEUE, one cache line each: the worker finishing a task only writes its own
+// slot, so workers finishing neighbouring ids (and the writer waiting on one of them) never share a line
+typedef struct {
+    _Alignas(CACHE_LINE) Result *result;    // Result of the task in the same slot of TASK_QUEUE
+    sem_t ready;                        // Semaphore for tracking the result is ready to write or not
+    bool written;                       // Written out of order with `--batch`, not given back to free_slots yet
+} Completion;
+
+// Pool struct for the state of the threads pool shared by the submitter, the workers and the writer, on lines of
+// its own so no read-mostly global shares them. The counters are only touched with the mutex held, so they stay on
+// the lines of the mutex: the thread taking the lock gets them with it, not one more line per critical section.
+// `free_slots` is posted by the writer without the lock, it gets a line of its own.
+typedef struct {
+    _Alignas(CACHE_LINE) pthread_mutex_t mutex;     // Mutex for queue
+    pthread_cond_t cond;                            // Condition variable for task queue
+    size_t submitted;                               // Tracking how many tasks are in the task queue
+    size_t processed;                               // Tracking task id that has been processed
+    bool all_processed;                             // Tracking if all of tasks are processed and no more will come
+    _Alignas(CACHE_LINE) sem_t free_slots;          // Semaphore for slots of the rings not taken by an unwritten task
+} Pool;
+
+// ShmOutput struct for the producing side of the ring
+typedef struct {
+    NyuRingHeader *ring;
+    size_t map_len;
+    int fd;                             // The shared-memory object, kept open to map the window
+    unsigned char *window;              // Buffer of the stream, mapped onto the data of slot `head`
+    uint64_t offset;                    // Bytes published so far
+} ShmOutput;
+
+// Tee struct for the output of `--verify`: written to `stdout`, and collected into segments
+typedef struct {
+    unsigned char *pending;             // Output not in a segment yet
+    size_t len;
+    size_t seq;
+    bool has_header;                    // The header (or its absence) is known
+    StreamHeader header;
+} Tee;
+
+
+extern Task **TASK_QUEUE;               // Task queue, task with id is at `id % MAX_TASK_NUM`
+extern Completion *RESULT_QUEUE;        // Result queue, same slot as its task
+extern Pool POOL;                       // Counters and locks of the task queue
+
+extern bool FOLLOW;                     // `-f`: keep encoding data appended to the inputs
+extern bool PERF;                       // `--perf`: hardware counters per thread and phase
+extern PerfThread *PERF_THREADS;        // Counters of each worker, then the writer
+extern int NUM_PERF_THREADS;
+extern _Thread_local PerfThread *PERF_SELF; // Counters of current thread
+extern bool LATENCY;                    // `--latency[=ms]`: latency histograms per thread
+extern long LATENCY_INTERVAL_MS;        // Dump the histograms periodically, 0 for only at exit
+extern LatencyThread *LATENCY_THREADS;  // Histograms of each worker, then the writer
+extern int NUM_LATENCY_THREADS;
+extern _Thread_local LatencyThread *LATENCY_SELF; // Histograms of current thread
+extern bool ANALYZE;                    // `--analyze`: run statistics of each input file
+extern bool ANALYZE_ONLY;               // `--analyze-only`: run statistics without writing the output
+extern size_t SUBMIT_FILE;              // Index of the input file being submitted, for Task.file
+extern Analysis **ANALYSIS;             // Statistics of each worker for each file
+extern Analysis *JOINED;                // Runs of each file joined over tasks by the writer
+extern Analysis JOINED_TOTAL;           // Runs joined over tasks and files by the writer of a stream
+extern size_t *NUM_ANALYSIS;            // Files allocated in ANALYSIS of each worker
+extern _Thread_local int WORKER_INDEX;  // Index of current worker thread
+extern const char *SERVE_PATH;          // Socket path of `--serve`, NULL if not running as a daemon
+extern const char *APPEND_STATE_PATH;   // State file of `--append-state`, NULL if encoding from the beginning
+extern const char *CACHE_PATH;          // Chunk cache file of `--cache`, NULL if chunk cache is not used
+extern Cache *CACHE;                    // Mapped chunk cache file
+extern size_t CACHE_HITS;               // Chunks whose pairs came from the chunk cache
+extern size_t CACHE_LOOKUPS;            // Chunks looked up in the chunk cache
+extern int FILTER;                      // `--filter=delta|xor[:stride]`: pre-filter of the input
+extern size_t STRIDE;                   // Record length of the filter
+extern unsigned char STREAM_TAIL[MAX_STRIDE]; // Last MAX_STRIDE bytes of the input submitted so far, for `--filter`
+extern int WIDTH;                       // `--width=bit|8|16|32|64`: bits of the elements runs are made of
+extern size_t PAIR_LEN;                 // Bytes of a pair: the element (a byte for `bit`) and its count
+extern bool ENTROPY;                    // `--entropy`: Huffman code the pairs of each task into its own frame
+extern bool VERIFY;                     // `--verify`: decode the output while it is written and compare with the input
+extern const char *BASE_PATH;           // `--base file`: XOR the input with this file before encoding
+extern const unsigned char *BASE;       // Mapped base file
+extern size_t BASE_LEN;
+extern size_t SUBMIT_OFFSET;            // Offset in the input of the next byte submitted, for Task.offset
+extern const char *BATCH_DIR;           // `--batch dir`: encode each input to its own file in dir
+extern BatchFile *SUBMIT_BATCH;         // Output of the input file being submitted, for Task.batch
+extern FILE *BATCH_MANIFEST;            // Manifest of `--batch`, one line for each output as it is closed
+extern pthread_mutex_t BATCH_MUTEX;     // Mutex for the manifest and giving slots back
+extern pthread_cond_t BATCH_COND;
+extern sem_t BATCH_SLOTS;               // Outputs that may be opened
+extern size_t BATCH_CLOSED;             // Outputs closed so far
+extern size_t RETIRED_TASKS;            // Tasks whose slot is given back to POOL.free_slots with `--batch`
+extern InputSource *INPUT_SOURCES;      // `-r` and `-@` in the order given, after the files of argv
+extern int NUM_INPUT_SOURCES;
+extern unsigned SHARD_INDEX;            // `--shard i/N`: encode the i-th of N ranges of the input
+extern unsigned SHARD_COUNT;            // 0 without `--shard`
+extern bool COLUMNAR;                   // `--columnar`: each task is a block of its elements, then their counts
+extern bool CRC;                        // `--crc`: each task is a frame with the CRC32C of its input and of its pairs
+extern bool UNORDERED;                  // `--unordered`: workers write each chunk as a record once it is encoded
+extern pthread_mutex_t RECORD_MUTEX;    // Mutex for writing records to `stdout`
+extern size_t CHUNK_LEN;                // `--chunk KB`: bytes of a task of a mapped file, CHUNK_SIZE if not given
+extern bool TUNE;                       // `--tune`: time a sample of the inputs over a grid of `-j` and `--chunk`
+extern bool JOBS_AUTO;                  // `-j auto`: `-j` and `--chunk` of `--tune` for this host and data
+extern const char *SHM_NAME;            // `--shm name`: write the output into a shared-memory ring instead of `stdout`
+extern bool HUGE_PAGES;                 // `--hugepages[=MB]`: rings and an arena for tasks and results on 2MB pages
+extern size_t ARENA_LEN;                // Bytes of the arena
+extern bool THP_INPUT;                  // `--thp-input`: ask for transparent huge pages on the mapped inputs
+extern const Filter FILTERS[NUM_FILTERS];
+
+// nyuenc.c: the threads pool, the encoder, the writer and the options
+void down(sem_t *sem);
+void up(sem_t *sem);
+void handle_error(const char *message, int fd);
+uint64_t get_le(const unsigned char *p, size_t len);
+int parsing_j(int argc, char **argv);
+void write_pair(Writer *writer, uint64_t current_char, size_t current_count);
+void merge_run(Writer *writer, uint64_t result_char, size_t result_count);
+bool has_header();
+void report_cache();
+void xor_base(unsigned char *out, const unsigned char *in, size_t len, size_t offset);
+void open_base(const char *path);
+void canonical_codes(Huffman *huffman);
+uint32_t crc32c(uint32_t crc, const unsigned char *p, size_t len);
+void *writer_process(void *args);
+size_t submit_file(int fd, size_t skip, Pack *pack, size_t *id);
+void submit_poison(Pack *pack, size_t *id);
+void finish_job();
+
+// tools.c: tools on encoded files
+void read_header(const char *path, const unsigned char *p, size_t len, StreamHeader *header);
+const unsigned char *map_encoded(const char *path, size_t *len, StreamHeader *header);
+int run_tool(int argc, char **argv);
+
+// decode.c: decoders and `--verify`
+void tool_check(int argc, char **argv, int num_threads);
+void tool_decode(int argc, char **argv, int num_threads);
+void verify_open(int argc, char **argv);
+ssize_t tee_write(void *cookie, const char *buf, size_t size);
+int tee_close(void *cookie);
+void *verify_process(void *args);
+void verify_finish(pthread_t *threads, int num_threads);
+
+// serve.c: daemon mode
+void serve(const char *path);
+int request_daemon(const char *path, int argc, char **argv);
+
+// shm.c: `--shm`
+FILE *shm_open_output(ShmOutput *shm, const char *name);
+
+#endif
@@ -0,0 +1,189 @@
+// nyuring.h: the shared-memory ring of `nyuenc --shm name`, and a small library for the process reading it.
+//
+// nyuenc writes its output in order into the slots of a POSIX shared-memory object, the reader maps the same object
+// and reads each slot in place, no pipe and no copy through the kernel. The producer cursor `head` (slots published)
+// and the consumer cursor `tail` (slots released) are futex words, a side only sleeps on the other's cursor when the
+// ring is empty (or full), and is only woken when it said it sleeps.
+//
+//     NyuReader reader;
+//     if (nyuring_open(&reader, "/out") == -1) { perror("nyuring_open"); exit(EXIT_FAILURE); }
+//     size_t len;
+//     const unsigned char *p;
+//     while ((p = nyuring_next(&reader, &len)) != NULL) {
+//         consume(p, len);                 // the bytes stay valid until the slot is released
+//         nyuring_release(&reader);
+//     }
+//     nyuring_close(&reader);
+//
+// There is one reader for each ring, nyuring_open() removes the name once the ring is mapped.
+
+#ifndef NYURING_H
+#define NYURING_H
+
+#include <stdint.h>         // uint32_t, uint64_t
+#include <stddef.h>         // size_t
+#include <stdbool.h>        // bool
+#include <string.h>         // memcmp
+#include <errno.h>          // errno, EINVAL
+#include <limits.h>         // INT_MAX
+#include <time.h>           // nanosleep
+#include <fcntl.h>          // O_RDWR
+#include <unistd.h>         // close, syscall
+#include <sys/mman.h>       // mmap, shm_open, shm_unlink
+#include <sys/stat.h>       // fstat
+#include <sys/syscall.h>    // SYS_futex
+#include <linux/futex.h>    // FUTEX_WAIT, FUTEX_WAKE
+
+#define NYURING_MAGIC "NYURING1"
+#define NYURING_PAGE 4096           // the header, the slot heads and the data each start on a page
+
+// NyuRingHeader struct at the start of the ring, each cursor on its own cache line with the flag of its writer
+typedef struct {
+    char magic[8];
+    uint32_t num_slots;                 // Power of 2, so the cursors can wrap
+    uint32_t slot_size;                 // Bytes of output a slot holds
+    uint32_t ready;                     // Set last by the producer, the fields above are valid
+    _Alignas(64) uint32_t head;         // Slots published by the producer
+    uint32_t closed;                    // The producer published all of the output
+    uint32_t producer_waiting;          // The producer sleeps on `tail`
+    _Alignas(64) uint32_t tail;         // Slots released by the consumer
+    uint32_t consumer_waiting;          // The consumer sleeps on `head`
+} NyuRingHeader;
+
+// NyuRingSlot struct for the head of a slot, the data of slot i is at nyuring_data(ring, i)
+typedef struct {
+    _Alignas(64) uint64_t offset;       // Offset of the slot in the output
+    uint32_t len;                       // Bytes of output in the slot
+} NyuRingSlot;
+
+// NyuReader struct for the reading side of a ring
+typedef struct {
+    NyuRingHeader *ring;
+    size_t map_len;
+    uint32_t next;                      // Next slot to read, slots from `tail` to `next` are held by the reader
+} NyuReader;
+
+// Bytes of the slot heads, rounded up to a page
+static inline size_t nyuring_heads_len(uint32_t num_slots) {
+    return (num_slots * sizeof(NyuRingSlot) + NYURING_PAGE - 1) / NYURING_PAGE * NYURING_PAGE;
+}
+
+// Bytes of a ring of num_slots slots of slot_size bytes
+static inline size_t nyuring_len(uint32_t num_slots, uint32_t slot_size) {
+    return NYURING_PAGE + nyuring_heads_len(num_slots) + (size_t)num_slots * slot_size;
+}
+
+// Head of the slot of cursor i
+static inline NyuRingSlot *nyuring_slot(NyuRingHeader *ring, uint32_t i) {
+    return (NyuRingSlot *)((char *)ring + NYURING_PAGE) + (i & (ring->num_slots - 1));
+}
+
+// Data of the slot of cursor i
+static inline unsigned char *nyuring_data(NyuRingHeader *ring, uint32_t i) {
+    return (unsigned char *)ring + NYURING_PAGE + nyuring_heads_len(ring->num_slots)
+           + (size_t)(i & (ring->num_slots - 1)) * ring->slot_size;
+}
+
+// Sleep while *word is value, the ring is shared between processes so the futex is not private
+static inline void nyuring_wait(uint32_t *word, uint32_t value) {
+    syscall(SYS_futex, word, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+// Wake the other side sleeping on *word
+static inline void nyuring_wake(uint32_t *word) {
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Open the ring of name (as given to `--shm`), wait for the producer to set it up. Return -1 with errno on error.
+static inline int nyuring_open(NyuReader *reader, const char *name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        return -1;
+    }
+
+    // the producer sizes the object, then fills the header and sets `ready` last
+    struct timespec pause = {0, 1000000};
+    struct stat sb;
+    NyuRingHeader *ring = MAP_FAILED;
+    while (1) {
+        if (fstat(fd, &sb) == -1) {
+            close(fd);
+            return -1;
+        }
+        if ((size_t)sb.st_size >= NYURING_PAGE) {
+            ring = (ring != MAP_FAILED) ? ring : mmap(NULL, NYURING_PAGE, PROT_READ, MAP_SHARED, fd, 0);
+            if (ring == MAP_FAILED) {
+                close(fd);
+                return -1;
+            }
+            if (__atomic_load_n(&ring->ready, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+        }
+        nanosleep(&pause, NULL);
+    }
+
+    uint32_t num_slots = ring->num_slots, slot_size = ring->slot_size;
+    bool ok = memcmp(ring->magic, NYURING_MAGIC, 8) == 0 && num_slots > 0 && (num_slots & (num_slots - 1)) == 0
+              && (size_t)sb.st_size >= nyuring_len(num_slots, slot_size);
+    munmap(ring, NYURING_PAGE);
+    if (!ok) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    reader->map_len = nyuring_len(num_slots, slot_size);
+    reader->ring = mmap(NULL, reader->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (reader->ring == MAP_FAILED) {
+        return -1;
+    }
+    reader->next = __atomic_load_n(&reader->ring->tail, __ATOMIC_ACQUIRE);
+    shm_unlink(name);
+    return 0;
+}
+
+// Wait for the next slot and return its bytes (len of them), or NULL at the end of the output.
+// The bytes can be read in place until the slot is released.
+static inline const unsigned char *nyuring_next(NyuReader *reader, size_t *len) {
+    NyuRingHeader *ring = reader->ring;
+    while (1) {
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head != reader->next) {
+            *len = nyuring_slot(ring, reader->next)->len;
+            return nyuring_data(ring, reader->next++);
+        }
+        // `closed` is set after the last slot is published, so `head` is final once it is seen
+        if (__atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != reader->next) {
+                continue;
+            }
+            return NULL;
+        }
+
+        __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == head
+            && !__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST)) {
+            nyuring_wait(&ring->head, head);
+        }
+        __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Give the oldest slot returned by nyuring_next() back to the producer
+static inline void nyuring_release(NyuReader *reader) {
+    NyuRingHeader *ring = reader->ring;
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->producer_waiting, __ATOMIC_SEQ_CST)) {
+        nyuring_wake(&ring->tail);
+    }
+}
+
+// Unmap the ring
+static inline void nyuring_close(NyuReader *reader) {
+    munmap(reader->ring, reader->map_len);
+    reader->ring = NULL;
+}
+
+#endif
@@ -0,0 +1,379 @@
+#!/bin/bash
+# Checks of nyuenc on generated inputs: an option must give the output of a plain run, or decode back to its input.
+# usage: ./roundtrip.sh [path/to/nyuenc]     (`make check` builds nyuenc and runs it)
+
+NYUENC=$(realpath "${1:-./nyuenc}")
+SRC=$(dirname "$(realpath "$0")")
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+failed=0
+
+fail() {
+    echo "FAIL: $*"
+    failed=1
+}
+
+# encode with the options and inputs given, the output must be expected (stderr goes to err)
+encodes_to() {
+    local expected=$1
+    shift
+    "$NYUENC" "$@" > out.enc 2> err || { fail "nyuenc $*"; return; }
+    cmp -s out.enc "$expected" || fail "nyuenc $* differs from $expected"
+}
+
+# inputs: short and long runs, random bytes, records, both of the first two, a sparse file and a copy with no holes
+head -c 300000 /dev/urandom | tr '\000-\377' '[a*128][b*128]' > runs
+for i in $(seq 50); do head -c $((i * 97)) /dev/zero | tr '\0' 'x' >> runs; printf 'yz' >> runs; done
+head -c 200000 /dev/urandom > random
+seq 100000 150000 > records
+cat runs random > both
+truncate -s 1M sparse && printf 'data' | dd of=sparse bs=1 seek=500000 conv=notrunc 2> /dev/null
+cat records >> sparse && truncate -s 2M sparse
+cp --sparse=never sparse dense
+"$NYUENC" both > both.enc
+"$NYUENC" dense > dense.enc
+
+# holes are encoded like the zeros they read as
+encodes_to dense.enc sparse
+encodes_to dense.enc -j 3 sparse
+encodes_to both.enc -j 3 runs random
+
+# small files are packed into tasks and encoded like their concatenation
+small=$(seq -f 'small.%g' 40)
+for i in $(seq 40); do tail -c +$((i * 1000)) runs | head -c $((i * 37)) > small.$i; done
+cat $small > small.all
+"$NYUENC" small.all > small.enc
+encodes_to small.enc $small
+encodes_to small.enc -j 3 $small
+
+# a daemon on a socket encodes for the thin client
+start_daemon() {
+    "$NYUENC" -j 2 --serve "$DIR/sock" 2> /dev/null &
+    daemon=$!
+    for i in $(seq 50); do [ -S sock ] && return; sleep 0.1; done
+    fail "--serve did not create its socket"
+}
+stop_daemon() {
+    kill $daemon
+    wait $daemon 2> /dev/null
+    rm -f sock
+}
+start_daemon
+NYUENC_SOCKET="$DIR/sock" encodes_to both.enc runs random
+NYUENC_SOCKET="$DIR/sock" encodes_to small.enc $small
+stop_daemon
+
+# a cold and a warm --cache give the output of a plain run
+encodes_to both.enc --cache cache both
+encodes_to both.enc --cache cache both
+grep -q "hit" err || fail "--cache reports no hit ratio"
+
+# a growing input continued with --append-state gives the output of one run
+head -c 100000 both > growing
+"$NYUENC" --append-state state growing > growing.enc || fail "--append-state"
+tail -c +100001 both >> growing
+"$NYUENC" --append-state state growing >> growing.enc || fail "--append-state resumed"
+cmp -s growing.enc both.enc || fail "--append-state differs from one run"
+
+# -f encodes what is appended to its input until SIGINT
+follow() {
+    head -c 100000 both > followed
+    "$NYUENC" -f followed > followed.enc 2> /dev/null &
+    local pid=$!
+    sleep 0.3
+    tail -c +100001 both >> followed
+    sleep 0.5
+    kill -INT $pid
+    wait $pid || fail "-f $*"
+    cmp -s followed.enc both.enc || fail "-f $* differs from one run"
+}
+follow
+
+# --perf only reports on stderr: the counters, or one line saying there are none (no PMU, perf_event_paranoid)
+encodes_to both.enc --perf both
+if grep -q "IPC" err; then
+    grep -q "not available" err && fail "--perf reports counters and says they are not available"
+else
+    [ "$(cat err)" = "nyuenc: --perf: hardware counters are not available" ] || fail "--perf without counters"
+fi
+
+# --latency only reports on stderr, a row for each stage with p50 <= p99 <= p99.9 <= max
+encodes_to both.enc --latency both
+for column in 'p50(us)' 'p99(us)' 'p99.9(us)' 'max(us)'; do
+    grep -qF "$column" err || fail "--latency has no $column"
+done
+for stage in encode wait order; do
+    awk -v stage=$stage '$2 == stage && $3 > 0 && $4 <= $5 && $5 <= $6 && $6 <= $7 { found = 1 } END { exit !found }' err \
+        || fail "--latency row of $stage"
+done
+encodes_to both.enc --latency --perf -j 3 both
+grep -qF "p99.9(us)" err || fail "--latency with --perf has no report"
+
+# tools on encoded files: cat is the encoding of the inputs together, size and hist count the original bytes
+"$NYUENC" runs > runs.enc
+"$NYUENC" random > random.enc
+"$NYUENC" cat runs.enc random.enc > cat.enc || fail "cat"
+cmp -s cat.enc both.enc || fail "cat of runs and random differs from both"
+# the pairs copied as is go out from -j threads into a file, after what is in it already, in order into a pipe
+head -c 3M /dev/urandom > big
+cat big runs big > big3
+"$NYUENC" big3 > big3.enc
+"$NYUENC" big > big.enc
+{ printf "xx"; "$NYUENC" cat -j 3 big.enc runs.enc big.enc; } > cat.enc || fail "cat -j 3 into a file"
+cmp -s <(tail -c +3 cat.enc) big3.enc || fail "cat -j 3 into a file differs"
+"$NYUENC" cat -j 3 big.enc runs.enc big.enc | cmp -s - big3.enc || fail "cat -j 3 into a pipe differs"
+printf "xx" > cat.enc
+"$NYUENC" cat -j 3 big.enc runs.enc big.enc >> cat.enc || fail "cat -j 3 appended"
+cmp -s <(tail -c +3 cat.enc) big3.enc || fail "cat -j 3 appended differs"
+rm -f big big3 big.enc big3.enc
+[ "$("$NYUENC" size both.enc)" = "$(stat -c %s both) both.enc" ] || fail "size of both.enc"
+od -An -v -tx1 -w1 runs | sort | uniq -c | awk '{ print "0x" $2, $1 }' > hist.expected
+"$NYUENC" hist -j 3 runs.enc > hist.out || fail "hist"
+cmp -s hist.out hist.expected || fail "hist of runs.enc"
+
+# --analyze reports on stderr, --analyze-only reports on stdout instead of the output
+encodes_to both.enc --analyze both
+grep -q "^both: .* bytes encoded" err || fail "--analyze reports nothing"
+"$NYUENC" --analyze-only both > report || fail "--analyze-only"
+grep -q "^both: .* bytes encoded" report || fail "--analyze-only does not report"
+
+# decode file.enc [decode options...] and compare with the input
+decodes_to() {
+    local input=$1 encoded=$2
+    shift 2
+    "$NYUENC" decode "$@" "$encoded" > decoded || { fail "decode $encoded $*"; return; }
+    cmp -s decoded "$input" || fail "decode $encoded $* differs from $input"
+}
+
+# encode input with options and decode it back
+roundtrip() {
+    local input=$1
+    shift
+    "$NYUENC" -j 3 "$@" "$input" > out.enc || { fail "encode $input $*"; return; }
+    decodes_to "$input" out.enc
+}
+
+for input in runs random records sparse; do
+    roundtrip $input
+    roundtrip $input --filter=delta
+    roundtrip $input --filter=delta:4
+    roundtrip $input --filter=xor:4
+done
+
+for input in runs random records sparse; do
+    for width in bit 16 32 64; do
+        roundtrip $input --width=$width
+    done
+done
+roundtrip records --width=32 --filter=delta:4
+
+# a decoder refuses a partial pair and a trailer longer than an element
+printf 'abc' > odd
+"$NYUENC" --width=16 odd > odd.enc
+decodes_to odd odd.enc
+head -c -1 odd.enc > partial.enc
+"$NYUENC" decode partial.enc > /dev/null 2>&1 && fail "decode of a partial pair"
+cp odd.enc trailer.enc
+printf '\002' | dd of=trailer.enc bs=1 seek=11 conv=notrunc 2> /dev/null
+"$NYUENC" decode trailer.enc > /dev/null 2>&1 && fail "decode of a trailer of 2 bytes with --width=16"
+
+for input in runs random records sparse; do
+    roundtrip $input --entropy
+    "$NYUENC" --entropy $input > out.enc && decodes_to $input out.enc -j 3
+done
+roundtrip records --entropy --width=32 --filter=delta:4
+
+# --append-state keeps the options of the stream header, and refuses to resume with others
+append() {
+    rm -f state
+    head -c 100000 both > growing
+    "$NYUENC" "$@" --append-state state growing > growing.enc || fail "--append-state $*"
+    tail -c +100001 both >> growing
+    "$NYUENC" "$@" --append-state state growing >> growing.enc || fail "--append-state $* resumed"
+    decodes_to growing growing.enc
+}
+append_changed() {
+    rm -f state
+    head -c 100000 both > growing
+    "$NYUENC" --append-state state growing > growing.enc
+    tail -c +100001 both >> growing
+    "$NYUENC" "$@" --append-state state growing >> growing.enc 2> /dev/null && fail "--append-state resumed with $*"
+}
+for options in "" "--filter=delta" "--width=16" "--entropy"; do
+    append $options
+done
+append_changed --filter=delta
+append_changed --entropy
+
+for input in runs random records; do
+    "$NYUENC" --base both $input > out.enc && decodes_to $input out.enc --base both || fail "--base both $input"
+done
+"$NYUENC" --base runs both > out.enc && decodes_to both out.enc --base runs || fail "--base runs both"
+
+# --verify decodes the output while it is written
+for options in "" "--filter=delta" "--width=32" "--entropy"; do
+    "$NYUENC" --verify $options both > out.enc 2> err || fail "--verify $options"
+    grep -q "verified" err || fail "--verify $options did not verify"
+    decodes_to both out.enc
+done
+
+# --batch writes each input to its own output
+mkdir batch
+"$NYUENC" -j 3 --batch batch runs random records > /dev/null || fail "--batch"
+for input in runs random records; do
+    decodes_to $input batch/$input.enc
+done
+[ $(wc -l < batch/MANIFEST) = 3 ] || fail "--batch MANIFEST"
+
+# -@ reads the paths of a list, -r walks a directory
+printf 'runs\nrandom\n' > list
+encodes_to both.enc -@ list
+mkdir -p tree/sub && cp runs tree && cp random records tree/sub
+mkdir walked
+"$NYUENC" -j 3 --batch walked -r tree > /dev/null || fail "-r with --batch"
+for input in tree/runs tree/sub/random tree/sub/records; do
+    decodes_to $input walked/$input.enc
+done
+
+# huge pages change where the memory is, not the output
+encodes_to both.enc --hugepages=16 -j 3 both
+encodes_to dense.enc --thp-input sparse
+
+# shards stitched together are the output of a single run
+for i in 0 1 2; do
+    "$NYUENC" --shard $i/3 runs random > part.$i || fail "--shard $i/3"
+done
+"$NYUENC" stitch part.0 part.1 part.2 > stitched.enc || fail "stitch"
+cmp -s stitched.enc both.enc || fail "stitched shards differ from a single run"
+
+for input in runs random records sparse; do
+    roundtrip $input --unordered
+done
+
+# --shm writes into a ring that a consumer of nyuring.h reads
+cat > shmcat.c << 'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include "nyuring.h"
+
+int main(int argc, char *argv[]) {
+    NyuReader reader;
+    if (argc != 2 || nyuring_open(&reader, argv[1]) == -1) {
+        perror("nyuring_open");
+        exit(EXIT_FAILURE);
+    }
+    size_t len;
+    const unsigned char *p;
+    while ((p = nyuring_next(&reader, &len)) != NULL) {
+        fwrite(p, 1, len, stdout);
+        nyuring_release(&reader);
+    }
+    nyuring_close(&reader);
+    return 0;
+}
+EOF
+if ${CC:-cc} -std=gnu17 -I"$SRC" -o shmcat shmcat.c -lpthread; then
+    name=/nyuenc-check-$$
+    "$NYUENC" -j 3 --shm $name both &
+    producer=$!
+    for i in $(seq 50); do [ -e /dev/shm$name ] && break; sleep 0.1; done
+    ./shmcat $name > shm.enc || fail "shmcat"
+    wait $producer || fail "--shm"
+    cmp -s shm.enc both.enc || fail "--shm ring differs from stdout"
+
+    # 40MB of output wraps the ring of 32 slots, the window of the stream is mapped onto each slot in turn
+    head -c 20M /dev/urandom > big
+    "$NYUENC" -j 3 --shm $name big &
+    producer=$!
+    for i in $(seq 50); do [ -e /dev/shm$name ] && break; sleep 0.1; done
+    ./shmcat $name > shm.enc || fail "shmcat of a wrapped ring"
+    wait $producer || fail "--shm of a wrapped ring"
+    encodes_to shm.enc -j 3 big
+    rm -f big shm.enc
+else
+    fail "shmcat does not build with nyuring.h"
+fi
+
+for input in runs random records sparse; do
+    roundtrip $input --chunk 16
+    roundtrip $input --chunk 64 --width=bit
+done
+encodes_to both.enc --chunk 64 -j 3 both
+
+# --tune saves a -j and a chunk for the class of the inputs, -j auto takes them
+export XDG_CACHE_HOME=$DIR/cache-home
+encodes_to both.enc -j auto both
+"$NYUENC" --tune both > /dev/null 2>&1 || fail "--tune"
+[ -s cache-home/nyuenc/tune.$(hostname) ] || fail "--tune saved nothing"
+encodes_to both.enc -j auto both
+
+for input in runs random records sparse; do
+    roundtrip $input --crc
+done
+roundtrip records --crc --width=32 --filter=delta:4
+
+# `check` passes the frames of --crc and names a corrupt one
+"$NYUENC" --crc runs > crc.enc
+"$NYUENC" check crc.enc > /dev/null 2>&1 || fail "check of a good --crc output"
+cp crc.enc corrupt.enc
+offset=$(($(stat -c %s crc.enc) / 2))
+byte=$(od -An -tu1 -j $offset -N1 crc.enc)
+printf "\\$(printf %o $((byte ^ 0xFF)))" | dd of=corrupt.enc bs=1 seek=$offset conv=notrunc 2> /dev/null
+"$NYUENC" check corrupt.enc > /dev/null 2>&1 && fail "check of a corrupt frame"
+append --crc
+append_changed --crc
+
+for input in runs random records sparse; do
+    roundtrip $input --columnar
+    roundtrip $input --columnar --width=64
+done
+append --columnar
+append_changed --columnar
+
+# the layout of the rings and counters does not change the output at any -j
+for threads in 1 2 8; do
+    encodes_to both.enc -j $threads both
+    encodes_to dense.enc -j $threads --chunk 16 sparse
+done
+
+# options only encoded locally still work with NYUENC_SOCKET set
+start_daemon
+export NYUENC_SOCKET=$DIR/sock
+encodes_to both.enc --cache cache both
+grep -q "hit" err || fail "--cache with NYUENC_SOCKET reports no hit ratio"
+follow "with NYUENC_SOCKET"
+encodes_to both.enc --perf both
+grep -q "IPC\|not available" err || fail "--perf with NYUENC_SOCKET reports nothing"
+encodes_to both.enc --latency both
+grep -qF "p99.9(us)" err || fail "--latency with NYUENC_SOCKET reports nothing"
+encodes_to both.enc --hugepages=16 both
+encodes_to both.enc --chunk 16 both
+unset NYUENC_SOCKET
+stop_daemon
+"$NYUENC" --tune --cache cache both > /dev/null 2>&1 && fail "--tune with --cache"
+
+# a cache made for another --chunk is reset, a warm chunk of 16KB hits
+encodes_to both.enc --chunk 16 --cache cache both
+encodes_to both.enc --chunk 16 --cache cache both
+grep -q "hit ratio 0.0%" err && fail "--cache with --chunk 16 misses warm chunks"
+encodes_to both.enc --cache cache both
+# the class of --tune has the format options, its children encode by themselves with NYUENC_SOCKET set
+start_daemon
+NYUENC_SOCKET=$DIR/sock "$NYUENC" --tune --crc both > /dev/null 2>&1 || fail "--tune --crc"
+stop_daemon
+grep -q "/pairs+crc " cache-home/nyuenc/tune.$(hostname) || fail "--tune --crc saved no class with +crc"
+# --analyze counts the runs of the output: a run crossing chunks or files is one run
+head -c 100000 /dev/zero | tr '\0' 'a' > long
+for options in "" "--cache cache" "--cache cache"; do
+    "$NYUENC" --analyze-only -j 2 $options long runs sparse > report 2> /dev/null || fail "--analyze-only $options"
+    grep -q "^long: 100000 bytes, 1 runs (mean 100000.00, longest 100000)" report || fail "--analyze $options of long"
+    grep -q "^runs: .*longest 4850)" report || fail "--analyze $options of runs"
+    for input in long runs sparse total; do
+        [ $input = total ] && files="long runs sparse" || files=$input
+        encoded=$("$NYUENC" $files | wc -c)
+        grep -q "^$input: .* $encoded bytes encoded" report || fail "--analyze $options of $input is not $encoded bytes"
+    done
+done
+[ $failed = 0 ] && echo "ALL OK"
+exit $failed
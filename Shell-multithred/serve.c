@@ -0,0 +1,169 @@
+// serve.c: daemon mode, the `--serve` loop and the thin client of `NYUENC_SOCKET`.
+
+#include "nyuenc.h"
+
+/* Daemon mode: `nyuenc --serve path` keeps the threads pool (and the initialized RESULT_QUEUE) warm,
+   and `NYUENC_SOCKET=path nyuenc ...` sends the opened files to it instead of encoding by itself. */
+
+// Receive one request from a client: the output fd and the input fds. Return the number of input fds, or -1
+int receive_request(int conn, int *fds) {
+    Request request;
+    struct iovec iov = {&request, sizeof(request)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * (MAX_SERVE_FDS + 1))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(conn, &msg, 0) != sizeof(request)) {
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+
+    if (nfds != (int)request.nfiles + 1 || (msg.msg_flags & MSG_CTRUNC)) {
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return request.nfiles;
+}
+
+// Daemon loop: encode the files of each request with the same threads pool, one request at a time
+void serve(const char *path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        handle_error("create socket failed", -1);
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, SOMAXCONN) == -1) {
+        handle_error("bind socket failed", sock);
+    }
+
+    // a client closing its output early must not kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn == -1) {
+            continue;
+        }
+
+        int fds[MAX_SERVE_FDS + 1];
+        int nfiles = receive_request(conn, fds);
+        int status = EXIT_FAILURE;
+
+        if (nfiles >= 0) {
+            size_t id = 0;
+            Pack pack = {0};
+
+            Writer writer = {.out = fdopen(fds[0], "w")};
+            pthread_t writer_thread;
+            if (pthread_create(&writer_thread, NULL, writer_process, &writer) != 0) {
+                handle_error("Failed to create thread", -1);
+            }
+
+            for (int i = 1; i <= nfiles; i++) {
+                submit_file(fds[i], 0, &pack, &id);
+                close(fds[i]);
+            }
+            submit_poison(&pack, &id);
+
+            pthread_join(writer_thread, NULL);
+            report_cache();
+            finish_job();
+
+            status = (fclose(writer.out) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        // reply with the exit status of the job
+        if (write(conn, &status, sizeof(status)) == -1) {
+            perror("reply failed");
+        }
+        close(conn);
+    }
+}
+
+// Client side: open the files and send them with `stdout` to the daemon, then wait for the exit status.
+// Return -1 if the daemon can not be used, so the files are encoded locally instead.
+int request_daemon(const char *path, int argc, char **argv) {
+    int nfiles = argc - optind;
+    if (nfiles > MAX_SERVE_FDS) {
+        return -1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        return -1;
+    }
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    int fds[MAX_SERVE_FDS + 1];
+    fds[0] = STDOUT_FILENO;
+    for (int i = 0; i < nfiles; i++) {
+        fds[i + 1] = open(argv[optind + i], O_RDONLY);
+        if (fds[i + 1] == -1) {
+            handle_error("open fd failed", sock);
+        }
+    }
+
+    Request request = {nfiles};
+    struct iovec iov = {&request, sizeof(request)};
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * (MAX_SERVE_FDS + 1))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (nfiles + 1));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (nfiles + 1));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (nfiles + 1));
+
+    if (sendmsg(sock, &msg, 0) != sizeof(request)) {
+        close(sock);
+        return -1;
+    }
+    for (int i = 0; i < nfiles; i++) {
+        close(fds[i + 1]);
+    }
+
+    // the daemon owns the files now, so a lost reply is a failure rather than a fallback
+    int status;
+    if (read(sock, &status, sizeof(status)) != sizeof(status)) {
+        status = EXIT_FAILURE;
+    }
+    close(sock);
+    return status;
+}
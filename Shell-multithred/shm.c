@@ -0,0 +1,107 @@
+// shm.c: the writing side of the shared-memory ring of `--shm`, nyuring.h is the reading side.
+
+#include "nyuenc.h"
+
+/* Shared-memory output: `--shm name` writes the output into the slots of a POSIX shared-memory ring (see nyuring.h)
+   instead of `stdout`, so a consumer process reads it in place instead of through a pipe. The writer keeps writing to
+   a FILE whose buffer is a window mapped onto the slot being filled, so the bytes land in the ring as they are
+   written: a flush of the buffer only publishes the slot and maps the window onto the next free one. A flush (follow
+   mode) publishes a partial slot. Writes of a slot or more skip the buffer in stdio and are copied into slots. */
+
+// Wait until the consumer releases a slot if all of them are published
+void shm_wait_slot(NyuRingHeader *ring) {
+    uint32_t tail;
+    while (ring->head - (tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) == SHM_SLOTS) {
+        __atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail) {
+            nyuring_wait(&ring->tail, tail);
+        }
+        __atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Map the window onto the data of slot `head`, over the mapping of the previous slot
+void shm_map_window(ShmOutput *shm) {
+    off_t offset = nyuring_data(shm->ring, shm->ring->head) - (unsigned char *)shm->ring;
+    void *window = mmap(shm->window, SHM_SLOT_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE | (shm->window != NULL ? MAP_FIXED : 0), shm->fd, offset);
+    if (window == MAP_FAILED) {
+        handle_error("mmap failed", -1);
+    }
+    shm->window = window;
+}
+
+// Publish slot `head` with len bytes, then wait for the next slot to be free and map the window onto it
+void shm_publish(ShmOutput *shm, uint32_t len) {
+    NyuRingHeader *ring = shm->ring;
+    NyuRingSlot *slot = nyuring_slot(ring, ring->head);
+    slot->offset = shm->offset;
+    slot->len = len;
+    shm->offset += len;
+
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->consumer_waiting, __ATOMIC_SEQ_CST)) {
+        nyuring_wake(&ring->head);
+    }
+    shm_wait_slot(ring);
+    shm_map_window(shm);
+}
+
+// Write callback of the output stream of `--shm`: the buffer is already in slot `head`, other bytes are copied
+ssize_t shm_write(void *cookie, const char *buf, size_t size) {
+    ShmOutput *shm = cookie;
+
+    if ((const unsigned char *)buf == shm->window) {
+        shm_publish(shm, size);
+        return size;
+    }
+    for (size_t done = 0; done < size;) {
+        uint32_t len = (size - done < SHM_SLOT_SIZE) ? size - done : SHM_SLOT_SIZE;
+        memcpy(shm->window, buf + done, len);
+        shm_publish(shm, len);
+        done += len;
+    }
+    return size;
+}
+
+// Close callback of the output stream of `--shm`: mark the output complete and wake the consumer
+int shm_close(void *cookie) {
+    ShmOutput *shm = cookie;
+    __atomic_store_n(&shm->ring->closed, 1, __ATOMIC_SEQ_CST);
+    nyuring_wake(&shm->ring->head);
+    munmap(shm->window, SHM_SLOT_SIZE);
+    munmap(shm->ring, shm->map_len);
+    close(shm->fd);
+    return 0;
+}
+
+// Create the ring of name (a stale one of an earlier run is replaced) and return the output stream writing to it
+FILE *shm_open_output(ShmOutput *shm, const char *name) {
+    shm_unlink(name);
+    shm->fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (shm->fd == -1) {
+        handle_error("shm_open failed", -1);
+    }
+    shm->map_len = nyuring_len(SHM_SLOTS, SHM_SLOT_SIZE);
+    if (ftruncate(shm->fd, shm->map_len) == -1) {
+        handle_error("ftruncate failed", shm->fd);
+    }
+    shm->ring = mmap(NULL, shm->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, shm->fd, 0);
+    if (shm->ring == MAP_FAILED) {
+        handle_error("mmap failed", shm->fd);
+    }
+
+    memcpy(shm->ring->magic, NYURING_MAGIC, 8);
+    shm->ring->num_slots = SHM_SLOTS;
+    shm->ring->slot_size = SHM_SLOT_SIZE;
+    shm->offset = 0;
+    shm->window = NULL;
+    shm_map_window(shm);
+    __atomic_store_n(&shm->ring->ready, 1, __ATOMIC_RELEASE);
+
+    FILE *out = fopencookie(shm, "w", (cookie_io_functions_t){.write = shm_write, .close = shm_close});
+    if (out == NULL || setvbuf(out, (char *)shm->window, _IOFBF, SHM_SLOT_SIZE) != 0) {
+        handle_error("open shm stream failed", -1);
+    }
+    return out;
+}
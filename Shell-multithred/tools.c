@@ -0,0 +1,395 @@
+// tools.c: the tools on encoded files (`cat`, `size`, `hist`, `stitch`) and the dispatch of `nyuenc <tool>`.
+
+#include "nyuenc.h"
+
+/* Tools on encoded files, working on the pairs directly without decoding:
+   `nyuenc cat a.enc b.enc` concatenates, `nyuenc size x.enc` sums the counts, `nyuenc hist x.enc` counts each byte.
+   `size` and `hist` split the mapped pairs over `-j` threads (all CPUs by default), `cat` and `stitch` split the
+   pairs they copy as is over them when `stdout` is a regular file.
+   `nyuenc decode x.enc` writes the original input, undoing the filter named in the header of `--filter`. */
+
+// Read the header of `--filter` or `--width` at the start of an encoded file, a plain stream has none
+void read_header(const char *path, const unsigned char *p, size_t len, StreamHeader *header) {
+    header->len = 0;
+    header->filter = FILTER_NONE;
+    header->stride = 1;
+    header->width = 8;
+    header->entropy = false;
+    header->records = false;
+    header->crc = false;
+    header->columnar = false;
+    header->base = false;
+    if (p == NULL || len < HEADER_LEN || p[0] != 0 || p[1] != 0) {
+        return;
+    }
+
+    unsigned char mode = p[4] & ~0xA0;
+    if (memcmp(p + 2, "NY", 2) != 0 || (mode != 'U' && mode != 'H' && mode != 'R' && mode != 'C') || p[5] >= NUM_FILTERS
+        || p[6] < 1 || p[6] > MAX_STRIDE || (p[7] != 1 && p[7] != 8 && p[7] != 16 && p[7] != 32 && p[7] != 64)) {
+        fprintf(stderr, "nyuenc: %s: unknown stream header\n", path);
+        exit(EXIT_FAILURE);
+    }
+    header->len = HEADER_LEN;
+    header->filter = p[5];
+    header->stride = p[6];
+    header->width = p[7];
+    header->entropy = mode == 'H';
+    header->records = mode == 'R';
+    header->columnar = mode == 'C';
+    header->base = p[4] & 0x20;
+    header->crc = p[4] & 0x80;
+}
+
+// Map an encoded file and read its header, the rest must be whole pairs. Return NULL for an empty file.
+const unsigned char *map_encoded(const char *path, size_t *len, StreamHeader *header) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        handle_error("open fd failed", -1);
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1) {
+        handle_error("get size failed", fd);
+    }
+
+    *len = sb.st_size;
+    if (*len == 0) {
+        read_header(path, NULL, 0, header);
+        close(fd);
+        return NULL;
+    }
+
+    const unsigned char *addr = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        handle_error("map file failed", fd);
+    }
+    madvise((void *)addr, *len, MADV_SEQUENTIAL);
+    close(fd);
+
+    read_header(path, addr, *len, header);
+    size_t pair_len = (header->width == 1) ? 2 : header->width / 8 + 1;
+    if (!header->entropy && !header->records && !header->crc && !header->columnar
+        && (*len - header->len) % pair_len != 0) {
+        fprintf(stderr, "nyuenc: %s: not an encoded file (partial pair)\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return addr;
+}
+
+// Sum the counts of a part, 32 bytes (16 pairs) at a time as 16-bit lanes whose high byte is the count
+void *size_process(void *args) {
+    ToolWork *work = args;
+    const unsigned char *p = work->pairs;
+    size_t len = work->len;
+    uint64_t total = 0;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    typedef uint16_t v16u16 __attribute__((vector_size(32)));
+
+    while (len >= 32) {
+        // up to 257 * 255 fits in each 16-bit lane of acc
+        v16u16 acc = {0};
+        size_t blocks = len / 32 > 257 ? 257 : len / 32;
+        for (size_t b = 0; b < blocks; b++, p += 32) {
+            v16u16 v;
+            memcpy(&v, p, sizeof(v));
+            acc += v >> 8;
+        }
+        len -= blocks * 32;
+
+        for (int lane = 0; lane < 16; lane++) {
+            total += acc[lane];
+        }
+    }
+#endif
+
+    for (size_t j = 0; j < len; j += 2) {
+        total += p[j + 1];
+    }
+    work->total = total;
+    return NULL;
+}
+
+// Sum the counts of each byte of a part
+void *hist_process(void *args) {
+    ToolWork *work = args;
+    for (size_t j = 0; j < work->len; j += 2) {
+        work->hist[work->pairs[j]] += work->pairs[j + 1];
+    }
+    return NULL;
+}
+
+// Split the pairs at pair boundaries over threads (at least 1MB each), run `process` and merge into sum
+void run_parallel(const unsigned char *pairs, size_t len, int num_threads, void *(*process)(void *), ToolWork *sum) {
+    size_t max_threads = len / (1 << 20) + 1;
+    int n = (size_t)num_threads > max_threads ? (int)max_threads : num_threads;
+    ToolWork *works = calloc(n, sizeof(ToolWork));
+    pthread_t threads[n];
+
+    size_t part = (len / n) & ~(size_t)1;
+    for (int t = 0; t < n; t++) {
+        works[t].pairs = pairs + t * part;
+        works[t].len = (t == n - 1) ? len - t * part : part;
+        if (t > 0 && pthread_create(&threads[t], NULL, process, &works[t]) != 0) {
+            handle_error("Failed to create thread", -1);
+        }
+    }
+    process(&works[0]);
+
+    for (int t = 0; t < n; t++) {
+        if (t > 0) {
+            pthread_join(threads[t], NULL);
+        }
+        sum->total += works[t].total;
+        for (int b = 0; b < 256; b++) {
+            sum->hist[b] += works[t].hist[b];
+        }
+    }
+    free(works);
+}
+
+// Write a part of the pairs at its offset of `stdout`
+void *copy_process(void *args) {
+    ToolWork *work = args;
+    for (size_t done = 0; done < work->len;) {
+        ssize_t n = pwrite(STDOUT_FILENO, work->pairs + done, work->len - done, work->offset + done);
+        if (n <= 0) {
+            handle_error("write output failed", -1);
+        }
+        done += n;
+    }
+    return NULL;
+}
+
+// Copy pairs as is to the output. Into a regular file they are split over threads (at least 1MB each), each writing
+// its part at its own offset. A pipe, or a file opened to append, takes them in order through the stream.
+void copy_pairs(Writer *writer, const unsigned char *pairs, size_t len, int num_threads) {
+    writer->out_len += len;
+    size_t max_threads = len / (1 << 20);
+    int n = (max_threads < (size_t)num_threads) ? (int)max_threads : num_threads;
+    struct stat sb;
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    off_t offset = -1;
+    if (writer->out == stdout && n > 1 && fstat(STDOUT_FILENO, &sb) == 0 && S_ISREG(sb.st_mode) && flags != -1
+        && !(flags & O_APPEND) && fflush(stdout) == 0) {
+        offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    }
+    if (offset == -1) {
+        fwrite(pairs, sizeof(unsigned char), len, writer->out);
+        return;
+    }
+
+    ToolWork *works = calloc(n, sizeof(ToolWork));
+    pthread_t threads[n];
+    size_t part = len / n;
+    for (int t = 0; t < n; t++) {
+        works[t].pairs = pairs + t * part;
+        works[t].len = (t == n - 1) ? len - t * part : part;
+        works[t].offset = offset + t * part;
+        if (t > 0 && pthread_create(&threads[t], NULL, copy_process, &works[t]) != 0) {
+            handle_error("Failed to create thread", -1);
+        }
+    }
+    copy_process(&works[0]);
+    for (int t = 1; t < n; t++) {
+        pthread_join(threads[t], NULL);
+    }
+    free(works);
+
+    // the stream goes on after the pairs
+    if (lseek(STDOUT_FILENO, offset + len, SEEK_SET) == -1) {
+        handle_error("seek output failed", -1);
+    }
+}
+
+// `nyuenc cat`: write the files as one encoded stream. Only the boundary runs change: the leading pairs of a file
+// with the same char merge into the trailing run of the previous files (keeping the 255 cap), the rest is copied.
+void tool_cat(int argc, char **argv, int num_threads) {
+    Writer writer = {.out = stdout};
+
+    for (int arg = optind; arg < argc; arg++) {
+        size_t len;
+        StreamHeader header;
+        const unsigned char *p = map_encoded(argv[arg], &len, &header);
+        if (p == NULL) {
+            continue;
+        }
+
+        // the runs of a filtered stream depend on the bytes before it, it can not be joined as pairs
+        if (header.len > 0) {
+            fprintf(stderr, "nyuenc: %s: has a header of --filter or --width, decode it first\n", argv[arg]);
+            exit(EXIT_FAILURE);
+        }
+
+        // merge the leading run
+        size_t j = 0;
+        while (j < len && p[j] == p[0]) {
+            merge_run(&writer, p[j], p[j + 1]);
+            j += 2;
+        }
+
+        // copy the interior, and keep the last pair as trailing run
+        if (j < len) {
+            if (writer.current_count > 0) {
+                write_pair(&writer, writer.current_char, writer.current_count);
+            }
+            copy_pairs(&writer, p + j, len - 2 - j, num_threads);
+            writer.current_char = p[len - 2];
+            writer.current_count = p[len - 1];
+        }
+
+        munmap((void *)p, len);
+    }
+
+    if (writer.current_count > 0) {
+        write_pair(&writer, writer.current_char, writer.current_count);
+    }
+}
+
+// Bytes of the pairs of a run of count, as a single run writes it
+size_t run_bytes(uint64_t count) {
+    return (count + MAX_CHAR_LEN - 1) / MAX_CHAR_LEN * 2;
+}
+
+// `nyuenc stitch`: join the shards of `--shard` in order into the output of a single run. The head run of each shard
+// merges into the pending run, the pairs between head and tail run are copied, the tail run becomes the pending run.
+void tool_stitch(int argc, char **argv, int num_threads) {
+    Writer writer = {.out = stdout};
+    uint64_t next_offset = 0;
+
+    for (int arg = optind; arg < argc; arg++) {
+        int fd = open(argv[arg], O_RDONLY);
+        struct stat sb;
+        if (fd == -1 || fstat(fd, &sb) == -1) {
+            handle_error("open fd failed", fd);
+        }
+        ShardFooter footer;
+        size_t len = sb.st_size - sizeof(footer);
+        if ((size_t)sb.st_size < sizeof(footer) || pread(fd, &footer, sizeof(footer), len) != sizeof(footer)
+            || memcmp(footer.magic, "NYUSHARD", 8) != 0) {
+            fprintf(stderr, "nyuenc: %s: not a shard of --shard\n", argv[arg]);
+            exit(EXIT_FAILURE);
+        }
+        if (footer.index != (uint32_t)(arg - optind) || footer.count != (uint32_t)(argc - optind)
+            || footer.input_offset != next_offset) {
+            fprintf(stderr, "nyuenc: %s: shard %u/%u, expected shard %d/%d in order\n", argv[arg], footer.index,
+                    footer.count, arg - optind, argc - optind);
+            exit(EXIT_FAILURE);
+        }
+        size_t head = run_bytes(footer.head_count);
+        size_t tail = run_bytes(footer.tail_count);
+        if (head + tail > len || (footer.tail_count == 0 && head != len)) {
+            fprintf(stderr, "nyuenc: %s: corrupt shard\n", argv[arg]);
+            exit(EXIT_FAILURE);
+        }
+        next_offset += footer.input_len;
+
+        if (footer.head_count > 0) {
+            merge_run(&writer, footer.head_char, footer.head_count);
+        }
+        if (footer.tail_count > 0) {
+            if (writer.current_count > 0) {
+                write_pair(&writer, writer.current_char, writer.current_count);
+            }
+            const unsigned char *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                handle_error("map file failed", fd);
+            }
+            copy_pairs(&writer, p + head, len - head - tail, num_threads);
+            munmap((void *)p, len);
+
+            writer.current_char = footer.tail_char;
+            writer.current_count = 0;
+            merge_run(&writer, footer.tail_char, footer.tail_count);
+        }
+        close(fd);
+    }
+
+    if (writer.current_count > 0) {
+        write_pair(&writer, writer.current_char, writer.current_count);
+    }
+}
+
+// `nyuenc size` and `nyuenc hist`: original size, or bytes weighted by run length, of each file
+void tool_count(int argc, char **argv, int num_threads, bool hist) {
+    ToolWork *all = calloc(1, sizeof(ToolWork));
+
+    for (int arg = optind; arg < argc; arg++) {
+        ToolWork *sum = calloc(1, sizeof(ToolWork));
+        size_t len;
+        StreamHeader header;
+        const unsigned char *p = map_encoded(argv[arg], &len, &header);
+        if (p != NULL) {
+            // counts of a filtered stream are of the filtered bytes, the header is not a pair
+            if (header.entropy || header.records || header.crc || header.columnar) {
+                fprintf(stderr, "nyuenc: %s: frames of --entropy or --crc, records of --unordered or blocks of "
+                                "--columnar are not pairs, decode it first\n", argv[arg]);
+                exit(EXIT_FAILURE);
+            }
+            if (header.width != 8) {
+                fprintf(stderr, "nyuenc: %s: pairs of --width=%d are not bytes, decode it first\n",
+                        argv[arg], header.width);
+                exit(EXIT_FAILURE);
+            }
+            run_parallel(p + header.len, len - header.len, num_threads, hist ? hist_process : size_process, sum);
+            munmap((void *)p, len);
+        }
+
+        if (!hist) {
+            printf("%llu %s\n", (unsigned long long)sum->total, argv[arg]);
+        }
+        all->total += sum->total;
+        for (int b = 0; b < 256; b++) {
+            all->hist[b] += sum->hist[b];
+        }
+        free(sum);
+    }
+
+    if (!hist && argc - optind > 1) {
+        printf("%llu total\n", (unsigned long long)all->total);
+    }
+    for (int b = 0; hist && b < 256; b++) {
+        if (all->hist[b] > 0) {
+            printf("0x%02x %llu\n", b, (unsigned long long)all->hist[b]);
+        }
+    }
+    free(all);
+}
+
+
+// Run a tool if argv[1] names one (`cat`, `size`, `hist`, `decode`), return -1 otherwise
+int run_tool(int argc, char **argv) {
+    if (argc < 2 || (strcmp(argv[1], "cat") != 0 && strcmp(argv[1], "size") != 0 && strcmp(argv[1], "hist") != 0
+                     && strcmp(argv[1], "decode") != 0 && strcmp(argv[1], "stitch") != 0
+                     && strcmp(argv[1], "check") != 0 && strcmp(argv[1], "--check") != 0)) {
+        return -1;
+    }
+
+    // parse `-j` after the tool name, all CPUs by default
+    bool has_j = false;
+    for (int i = 2; i < argc; i++) {
+        has_j |= strncmp(argv[i], "-j", 2) == 0;
+    }
+    int num_threads = parsing_j(argc - 1, argv + 1);
+    if (!has_j || JOBS_AUTO) {
+        num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    optind++;       // optind of `argv + 1` to `argv`
+    if (NUM_INPUT_SOURCES > 0) {
+        fprintf(stderr, "nyuenc: %s takes encoded files as arguments, not -r or -@\n", argv[1]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (strcmp(argv[1], "cat") == 0) {
+        tool_cat(argc, argv, num_threads);
+    } else if (strcmp(argv[1], "decode") == 0) {
+        tool_decode(argc, argv, num_threads);
+    } else if (strcmp(argv[1], "stitch") == 0) {
+        tool_stitch(argc, argv, num_threads);
+    } else if (strcmp(argv[1], "check") == 0 || strcmp(argv[1], "--check") == 0) {
+        tool_check(argc, argv, num_threads);
+    } else {
+        tool_count(argc, argv, num_threads, strcmp(argv[1], "hist") == 0);
+    }
+    return fflush(stdout) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}